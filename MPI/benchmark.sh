@@ -0,0 +1,135 @@
+#!/bin/sh
+
+# Benchmark gol over a set of workloads, for each decomposition and
+# engine, with strong scaling (the same board on more processors) and
+# weak scaling (a board which grows with the processors, by rows, so
+# each one keeps the same number of cells). Each run is done WARMUP
+# times first, untimed, then REPEATS times, and the time per step
+# reported by gol -p is summed up as its median, 10th and 90th
+# percentiles, and cells per second at the median.
+#
+# Settings come from the environment:
+#
+#   NPROCS      processor counts to sweep (default "1 2 4 8")
+#   WORKLOADS   boards made by golgen (default "random sparse acorns guns")
+#   ENGINES     gol engines (default "byte bit hash stream"); hash runs on
+#               one processor only, and stream by rows only
+#   DECOMPS     row and/or checkerboard (default both)
+#   HALOS       halo exchanges of the byte engine (default twophase), any
+#               of twophase persistent neighbor shared rma packed
+#   STRONG_SIZE side of the strong scaling board (default 2048)
+#   WEAK_SIZE   side of the weak scaling board per processor (default 512)
+#   STEPS       steps per run (default 100)
+#   WARMUP      untimed runs first (default 1)
+#   REPEATS     timed runs (default 5)
+#   FORMAT      csv or json (default csv)
+#   MPIEXEC     how to start gol (default mpiexec)
+#
+# Results go to standard output, for example:
+#
+#   NPROCS="1 4" FORMAT=json ./benchmark.sh > output/bm.json
+
+NPROCS=${NPROCS:-"1 2 4 8"}
+WORKLOADS=${WORKLOADS:-"random sparse acorns guns"}
+ENGINES=${ENGINES:-"byte bit hash stream"}
+DECOMPS=${DECOMPS:-"row checkerboard"}
+HALOS=${HALOS:-twophase}
+STRONG_SIZE=${STRONG_SIZE:-2048}
+WEAK_SIZE=${WEAK_SIZE:-512}
+STEPS=${STEPS:-100}
+WARMUP=${WARMUP:-1}
+REPEATS=${REPEATS:-5}
+FORMAT=${FORMAT:-csv}
+MPIEXEC=${MPIEXEC:-mpiexec}
+
+BOARDS=${TMPDIR:-/tmp}/golbench.$$
+mkdir -p $BOARDS || exit 1
+trap 'rm -rf $BOARDS' EXIT
+
+first=1
+if [ "$FORMAT" = json ]; then
+    echo "["
+else
+    echo "workload,scaling,engine,decomp,halo,np,rows,cols,steps,repeats,median_s,p10_s,p90_s,cells_per_s"
+fi
+
+# Time one configuration, and print its line of results.
+run() {
+    workload=$1 scaling=$2 engine=$3 decomp=$4 halo=$5 np=$6 rows=$7 cols=$8
+    board=$BOARDS/${workload}_${rows}x${cols}.pbm
+    [ -f $board ] || ./golgen $workload $rows $cols $board || exit 1
+    flags="-e $engine -m $halo -i $board -t $STEPS -p"
+    [ $decomp = checkerboard ] && flags="$flags -k"
+
+    i=0
+    while [ $i -lt $WARMUP ]; do
+        $MPIEXEC -n $np ./gol $flags > /dev/null 2>&1
+        i=$((i + 1))
+    done
+    times=""
+    i=0
+    while [ $i -lt $REPEATS ]; do
+        t=$($MPIEXEC -n $np ./gol $flags 2>/dev/null | tail -n 1 | awk -F', ' '{print $NF}')
+        if [ -z "$t" ]; then
+            echo "gol failed: $MPIEXEC -n $np ./gol $flags" >&2
+            return
+        fi
+        times="$times $t"
+        i=$((i + 1))
+    done
+
+    # Nearest rank percentiles of the sorted times.
+    echo $times | tr ' ' '\n' | sort -g | awk -v fmt=$FORMAT -v first=$first \
+        -v w=$workload -v sc=$scaling -v e=$engine -v d=$decomp -v h=$halo -v np=$np \
+        -v rows=$rows -v cols=$cols -v steps=$STEPS '
+        { t[NR] = $1 }
+        END {
+            med = t[int((NR + 1) / 2)]
+            p10 = t[int(0.1 * (NR - 1)) + 1]
+            p90 = t[NR - int(0.1 * (NR - 1))]
+            cps = med > 0 ? rows * cols / med : 0
+            if (fmt == "json")
+                printf("%s  {\"workload\": \"%s\", \"scaling\": \"%s\", \"engine\": \"%s\", " \
+                       "\"decomp\": \"%s\", \"halo\": \"%s\", \"np\": %d, \"rows\": %d, " \
+                       "\"cols\": %d, \"steps\": %d, \"repeats\": %d, \"median_s\": %g, " \
+                       "\"p10_s\": %g, \"p90_s\": %g, \"cells_per_s\": %.6g}", first ? "" : ",\n",
+                       w, sc, e, d, h, np, rows, cols, steps, NR, med, p10, p90, cps)
+            else
+                printf("%s,%s,%s,%s,%s,%d,%d,%d,%d,%d,%g,%g,%g,%.6g\n", w, sc, e, d, h, np,
+                       rows, cols, steps, NR, med, p10, p90, cps)
+        }'
+    first=0
+}
+
+for workload in $WORKLOADS; do
+    for engine in $ENGINES; do
+        # Hashlife keeps the board on one processor, so it has no
+        # decomposition and doesn't scale.
+        if [ $engine = hash ]; then
+            run $workload strong $engine row twophase 1 $STRONG_SIZE $STRONG_SIZE
+            continue
+        fi
+        # Only the byte engine has the other halo exchanges, and the
+        # stream engine only splits the board by rows.
+        halos=$HALOS
+        [ $engine = byte ] || halos=twophase
+        decomps=$DECOMPS
+        if [ $engine = stream ]; then
+            case " $DECOMPS " in
+                *" row "*) decomps=row ;;
+                *) continue ;;
+            esac
+        fi
+        for decomp in $decomps; do
+            for halo in $halos; do
+                for np in $NPROCS; do
+                    run $workload strong $engine $decomp $halo $np $STRONG_SIZE $STRONG_SIZE
+                    run $workload weak $engine $decomp $halo $np $((WEAK_SIZE * np)) $WEAK_SIZE
+                done
+            done
+        done
+    done
+done
+
+[ "$FORMAT" = json ] && printf "\n]\n"
+exit 0
@@ -4,26 +4,125 @@
    $Id: gol.c,v 1.38 2008/11/28 19:42:56 edhartnett Exp $
 */
 
+#define _FILE_OFFSET_BITS 64
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <string.h>
+#include <ctype.h>
 #include <math.h>
+#include <stdint.h>
+#include <pthread.h>
 #include <mpi.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
 #ifdef LOGGING
 #include <mpe.h>
 #endif
 
-/* In the game of life, two's company, three's a crowd. */
+/* In the game of life, two's company, three's a crowd, and it takes
+ * three to make a new cell: the rule B3/S23. Other rules can be given
+ * with -r. */
 #define COMPANY 2
 #define A_CROWD 3
+#define NUM_PARENTS 3
+#define DEFAULT_RULE "B3/S23"
+#define MAX_NEIGHBORS 8
 
 /* Some constants. */
 #define NDIMS 2
-#define NUM_PARENTS 3
 #define MAX_NAME 255
-#define HBUF_SIZE 100
+
+/* The kinds of file we can read: P5 has a byte per cell, P2 has the
+ * cells as ASCII numbers, and P4 (a PBM file) has a bit per cell, with
+ * each row starting a new byte. P5 and P4 can also be written. */
+#define PGM_RAW 5
+#define PGM_ASCII 2
+#define PBM_RAW 4
+
+/* Output may also go to a single series file for the whole run, with
+ * keyframes and the changes in between (see init_series). */
+#define SERIES_FILE 0
+#define SERIES_MAGIC "GOLTS002"
+#define SERIES_HEADER_WORDS 6
+#define SERIES_HEADER_BYTES (SERIES_HEADER_WORDS * 8)
+#define SERIES_INDEX_WORDS 4
+#define SERIES_KEY_EVERY 100
+#define SERIES_VARINT_MAX 10
+
+/* Checkpoints are PBM files, with a comment giving the step they were
+ * taken after, the number of steps of the run, and the rule. */
+#define CKPT_FILE "ann/checkpoint.pbm"
+#define CKPT_TMP_FILE "ann/checkpoint.pbm.tmp"
+#define CKPT_COMMENT "gol checkpoint step %d of %d rule %s"
+
+/* Raw input is read in collective reads of no more than this many
+ * bytes each, so that huge local blocks don't overflow the int count
+ * of an MPI read. */
+#define READ_CHUNK (1 << 30)
+
+/* These are the engines which may be used to advance the board. The
+ * byte engine stores one cell per unsigned char, the bit engine packs
+ * 64 cells into each uint64_t word, the hash engine keeps the board in
+ * a quadtree of shared nodes, with Hashlife, and the stream engine
+ * keeps it in files, for boards bigger than memory. */
+#define ENGINE_BYTE 0
+#define ENGINE_BIT 1
+#define ENGINE_HASH 2
+#define ENGINE_STREAM 3
+
+/* The stream engine's two files, which take turns holding the board
+ * and the next generation of it. They are named for the process id of
+ * processor 0, so runs in the same directory don't share them. Unless
+ * asked for other bands, the bands of all the generations of a pass
+ * take about STREAM_BAND_BYTES, so they stay in the L2 cache as a band
+ * goes through them. */
+#define STREAM_FILE "ann/stream_%d_%d.pgm"
+#define STREAM_BAND_BYTES (1 << 21)
+
+/* In the bit-packed grid each local row holds the real cells plus a
+ * ghost column on either side, so local column c lives in bit c % 64
+ * of word c / 64 of the row. */
+#define CELLS_PER_WORD 64
+
+/* The bit engine reads its board, and writes it out, a band of rows
+ * at a time, through a byte grid of about BIT_BAND_BYTES, so the board
+ * is never all held a byte per cell. */
+#define BIT_BAND_BYTES (1 << 24)
+
+/* The cells of the Hashlife quadtree. Cells off the edge of the board
+ * are wall, which is always dead, so the board edge works as for the
+ * other engines, but the rule is the same everywhere. */
+#define HCELL_DEAD 0
+#define HCELL_LIVE 1
+#define HCELL_WALL 2
+
+/* The Hashlife hash table starts with HASH_BUCKETS buckets, and
+ * doubles when it has as many nodes. Nodes are allocated
+ * HASH_BLOCK_NODES at a time, and when there are more than
+ * HASH_MAX_NODES the board is rebuilt from scratch. Nodes may be up
+ * to HASH_MAX_LEVEL levels tall, for 2^(HASH_MAX_LEVEL - 2)
+ * generations at a time. */
+#define HASH_BUCKETS (1 << 16)
+#define HASH_BLOCK_NODES 4096
+#define HASH_MAX_NODES (1 << 22)
+#define HASH_MAX_LEVEL 34
+#define HASH_MULT 0x9e3779b97f4a7c15ULL
+
+/* These are the kernels the byte engine may use for each row, from
+ * plain C up to 64 cells per AVX-512 instruction. KERNEL_AUTO picks
+ * the best one the CPU supports at startup. */
+#define KERNEL_AUTO -1
+#define KERNEL_SCALAR 0
+#define KERNEL_SSE2 1
+#define KERNEL_AVX2 2
+#define KERNEL_AVX512 3
+#define NUM_KERNELS 4
 
 /* These are for the event numbers array used to log various events in
  * the program with the MPE library, which produces output for the
@@ -39,6 +138,10 @@
 #define CALCULATE 5 
 #define INGEST 6
 
+/* The histogram of step times has a bucket for each power of two
+ * microseconds. */
+#define NUM_BUCKETS 32
+
 /* Some error codes for when things go wrong. */
 #define ERR_FILE 1
 #define ERR_DUMB 2
@@ -52,6 +155,7 @@
 #define ERR_WRITE 10
 #define ERR_SWAP 11
 #define ERR_INIT 12
+#define ERR_BALANCE 13
 
 /* Error handling code derived from an MPI example here: 
    http://www.dartmouth.edu/~rc/classes/intro_mpi/mpi_error_functions.html */
@@ -67,10 +171,310 @@
       return e;                                                         \
    } while (0) 
 
+/* Refuse options which don't go together, with a message from
+ * processor 0 saying why. Only main uses this, where my_rank is. */
+#define ARGERR(...) do {                                                \
+      if (!my_rank)                                                     \
+         fprintf(stderr, __VA_ARGS__);                                  \
+      ERR(ERR_ARG);                                                     \
+   } while (0)
+
+/* These are the ways of filling the ghost zones. The two phase
+ * exchange sends rows, then columns which carry the corners, posting
+ * new requests each time. The persistent and neighbor exchanges set
+ * everything up once, send the corners straight to the diagonal
+ * neighbors, and finish in one phase, with persistent requests or
+ * with a neighborhood collective. The shared exchange keeps the grids
+ * in memory shared by the processors on a node, copies the blocks of
+ * the neighbors on the node straight out of their grids, and only
+ * sends messages to the neighbors on other nodes. The RMA exchange
+ * puts each block straight into the neighbor's ghost cells, in an
+ * access epoch opened only with the neighbors. The packed exchange is
+ * the two phase one, with the ghost columns copied by hand into
+ * contiguous buffers, instead of sent as a strided MPI type. */
+#define HALO_TWO_PHASE 0
+#define HALO_PERSISTENT 1
+#define HALO_NEIGHBOR 2
+#define HALO_SHARED 3
+#define HALO_RMA 4
+#define HALO_PACKED 5
+
+/* The directions of the eight neighbors. */
+#define NUM_DIRS 8
+#define DIR_UP 0
+#define DIR_DOWN 1
+#define DIR_LEFT 2
+#define DIR_RIGHT 3
+#define DIR_UP_LEFT 4
+#define DIR_UP_RIGHT 5
+#define DIR_DOWN_LEFT 6
+#define DIR_DOWN_RIGHT 7
+
+/* How the board of rows by cols cells is divided among the
+ * processors, which form a dims[0] by dims[1] grid in the Cartesian
+ * communicator comm (row decomposition is just a p by 1 grid). Each
+ * processor has ln rows
+ * and lc columns of the board, starting at row0 and col0, and knows
+ * the ranks of its neighbors, which are MPI_PROC_NULL at the edge of
+ * the board. */
+struct decomp
+{
+   MPI_Comm comm;
+   int rows, cols;
+   int dims[NDIMS], coords[NDIMS];
+   int ln, lc, row0, col0;
+   int up, down, left, right;
+};
+
+/* A one phase halo exchange. For each direction there is the rank of
+ * the neighbor, the type of the block of cells that goes that way,
+ * where in the local grid the block is sent from, and where the one
+ * coming back goes. The persistent requests are made for both grids,
+ * since they swap every step. The neighbor exchange instead uses a
+ * graph communicator with the neighbors that exist. The shared
+ * exchange has a window on the node communicator for each grid, and
+ * for each neighbor on the node, where its block for us starts in
+ * each of its grids, its row length, and the size of the block; the
+ * neighbors on other nodes get persistent requests. The RMA exchange
+ * has a window on each grid, the group of the neighbors, and where
+ * and as what type each block goes in the neighbor's grid. The packed
+ * exchange has the buffers for the ghost columns. */
+struct halo
+{
+   int method;
+   int nbr[NUM_DIRS];
+   MPI_Datatype types[NUM_DIRS];
+   MPI_Aint send_off[NUM_DIRS], recv_off[NUM_DIRS];
+   unsigned char *bufs[2];
+   MPI_Request req[2][2 * NUM_DIRS];
+   int nreq;
+   MPI_Comm graph;
+   int counts[NUM_DIRS];
+   MPI_Aint send_displs[NUM_DIRS], recv_displs[NUM_DIRS];
+   MPI_Datatype graph_types[NUM_DIRS];
+   MPI_Comm node;
+   MPI_Win wins[2];
+   unsigned char *nbr_bufs[2][NUM_DIRS];
+   int stride, nbr_stride[NUM_DIRS];
+   int block_rows[NUM_DIRS], block_cols[NUM_DIRS];
+   MPI_Group group;
+   MPI_Aint target_off[NUM_DIRS];
+   MPI_Datatype target_types[NUM_DIRS];
+   unsigned char *col_bufs;
+};
+
+/* A node of the Hashlife quadtree is a square of 2^level cells on a
+ * side, made of four nodes one level down; level 0 nodes are the cells
+ * themselves. Each node remembers its population, and the middle half
+ * of it 2^result_log generations on, once that is worked out. */
+struct hnode
+{
+   struct hnode *nw, *ne, *sw, *se;
+   struct hnode *result;
+   struct hnode *chain;
+   int level, state, result_log;
+   int64_t pop;
+};
+
+struct hblock
+{
+   struct hblock *next;
+   struct hnode nodes[HASH_BLOCK_NODES];
+};
+
+/* The Hashlife engine: the hash table of all nodes, the blocks they
+ * live in, the three cells, a wall node for each level, and the root
+ * node, of the given level, holding the rows by cols board. */
+struct hashlife
+{
+   struct hnode **table;
+   int nbuckets, nnodes;
+   struct hblock *blocks;
+   int used;
+   struct hnode cells[3];
+   struct hnode *walls[HASH_MAX_LEVEL + 1];
+   struct hnode *root;
+   int rows, cols, level;
+};
+
+/* The stream engine: the descriptors and names of its two files, with
+ * the one holding the board now in cur, and whether a file was renamed
+ * to an output file, and has to be made again before it is written.
+ * The files are raw PGM files of header_bytes of header. Each pass
+ * over them computes up to depth generations, in bands of band_rows
+ * rows, and levels holds a band and the two rows above it for every
+ * generation from the one in the file to the last one. */
+struct stream
+{
+   int fd[2], cur, given[2];
+   char name[2][MAX_NAME + 1];
+   MPI_Offset header_bytes;
+   int band_rows, depth;
+   long page;
+   unsigned char *levels;
+};
+
+/* Compute cells [j, end) of one row of the byte grid with vector
+ * instructions. up, mid and down point to the start of the rows above,
+ * at and below the row being computed, and every cell in [j, end) must
+ * have a left and right neighbor in memory. Each function does as many
+ * whole vectors as fit, the last one overlapping the one before so as
+ * to end at end, and returns the first cell it did not do (only short
+ * rows have any), which calculate_next_step then finishes one cell at
+ * a time. Live cells in
+ * cur may have any non-zero value, so each is clamped to one before
+ * adding up neighbors, and next gets 255 or 0, as in the scalar code.
+ * If live is not NULL, the cells born or staying alive are added to
+ * it, straight from the compare masks, counting the overlapping cells
+ * of the last vector only once. */
+typedef int (*row_kernel_t)(const unsigned char *up, const unsigned char *mid, 
+                            const unsigned char *down, unsigned char *out, int j, int end, 
+                            int *live);
+
+/* Jobs for the pool of worker threads. */
+#define JOB_QUIT 0
+#define JOB_CALCULATE 1
+#define JOB_COUNT 2
+#define JOB_CLEAR 3
+
+/* Split each thread's share of the rows into this many tiles, so
+ * there is something to steal when a thread falls behind. */
+#define TILES_PER_THREAD 4
+
+/* With active tiles, the local grid is cut into tiles of tile_size
+ * by tile_size cells, nrows by ncols of them. A tile is only computed
+ * if it, or one of the eight around it, changed in the last
+ * generation, or if it is on a side with a neighbor, whose ghost cells
+ * may have changed. Otherwise it is still, and the next grid, which
+ * holds the generation before this one, already has it right.
+ * nactive is how many tiles were computed in the last step. */
+struct tiles
+{
+   int tile_size, nrows, ncols;
+   unsigned char *changed, *was_changed;
+   int nactive;
+};
+
+/* Snapshots which are still being written, while the game goes on.
+ * Up to max of them are in flight, in a ring starting at slot first,
+ * each with its file, the request for the write, and the buffer the
+ * grid was copied to, of buf_size bytes. */
+struct snapshots
+{
+   int max, first, n;
+   MPI_File *fh;
+   MPI_Request *req;
+   unsigned char **buf;
+   size_t *buf_size;
+};
+
+/* The series file being written: its file handle, how often to write
+ * a keyframe, the frames so far and (on processor 0) their index, and
+ * where the next frame goes. prev holds the local cells of the last
+ * frame, for band row0, ln, which also has its own PBM types for
+ * keyframes, packed into bits. The runs between changed cells are
+ * encoded in changes, of changes_size bytes. */
+struct series
+{
+   MPI_File fh;
+   int key_every;
+   int nframes, max_frames;
+   int64_t *index;
+   MPI_Offset end;
+   unsigned char *prev, *bits, *changes;
+   size_t changes_size;
+   int row0, ln;
+   MPI_Datatype filetype, memtype;
+};
+
+/* Each worker thread has a queue of tiles, which it works from the
+ * front while idle threads steal from the back. */
+struct tile_queue
+{
+   pthread_mutex_t lock;
+   int head, tail;
+};
+
+struct pool_arg
+{
+   struct pool *pool;
+   int id;
+};
+
+/* A pool of worker threads for one rank, and the job they are
+ * working on. */
+struct pool
+{
+   int nthreads;
+   pthread_t *threads;
+   struct pool_arg *args;
+   struct tile_queue *queue;
+   pthread_barrier_t start, done;
+   int job;
+   int checkerboard, ln, lc, ghost, tile_rows, ntiles;
+   int first, last, first_col, last_col;
+   row_kernel_t row_kernel;
+   unsigned char *cur, *next;
+   int counting;
+   int64_t *counts;
+};
+
+/* A count of the live cells which is being added up on process 0 in
+ * the background, to be printed once it arrives. */
+struct reduction
+{
+   int pending, step;
+   int64_t my_total, total;
+   MPI_Request req;
+};
+
+/* The digests and totals of the last n boards, in a ring ending at
+ * newest, for finding cycles up to max steps long. */
+struct cycles
+{
+   int max, n, newest;
+   uint64_t *digest;
+   int64_t *total;
+};
+
+int run_pool(struct pool *pool, int job, int first, int last, int first_col, int last_col);
+int64_t count_rows(int checkerboard, int ln, int lc, int ghost, unsigned char *buf, int first, int last);
+int write_packed_rows(struct decomp *dc, MPI_File fh, MPI_Offset header_bytes, int checkerboard, 
+                      int format, int band_rows, uint64_t *pbuf, unsigned char *buf);
+
 /* global err buffer for MPI. */
 int resultlen;
 char err_buffer[MPI_MAX_ERROR_STRING];
 
+/* Timers for the same phases as the MPE events, which are kept in
+ * every build: when each phase last started, its total time and how
+ * many times it ran, and a histogram of the time each step took. */
+struct timers
+{
+   double start[NUM_EVENTS], total[NUM_EVENTS];
+   int calls[NUM_EVENTS];
+   double step_start;
+   int steps[NUM_BUCKETS];
+} timers;
+
+/* The rule: bit n of birth is set if a dead cell with n live
+ * neighbors comes to life, and of survive if a live one stays alive.
+ * table has the same as 255 or 0 for each count, for dead cells
+ * (birth) and live ones (survival), padded to 16 for the vector
+ * shuffles. It is set from -r before anything is computed, and only
+ * read after that, so the worker threads can share it. */
+struct rule
+{
+   int birth, survive;
+   unsigned char table[2][16];
+} rule;
+
+/* The byte engine computes rows in strips of block_cols columns, so
+ * the three rows it reads and the one it writes stay in cache however
+ * long the rows are. 0 is whole rows. Like the rule, it is set before
+ * anything is computed. */
+int block_cols;
+
 /* This will set up the MPE logging event numbers. */
 int
 init_logging(int my_rank, int event_num[][NUM_EVENTS])
@@ -111,66 +515,258 @@ init_logging(int my_rank, int event_num[][NUM_EVENTS])
 }
 
 
+/* Read a rule like B36/S23 (HighLife) into the rule tables. Either
+ * part may come first, and either may be empty. Births with no
+ * neighbors are not allowed, as the cells past the edge of the board
+ * are always dead. */
+int
+parse_rule(const char *text, struct rule *r)
+{
+   const char *c;
+   int *bits = NULL;
+   int n, alive;
+
+   r->birth = r->survive = 0;
+   for (c = text; *c; c++)
+   {
+      if (toupper((unsigned char)*c) == 'B')
+         bits = &r->birth;
+      else if (toupper((unsigned char)*c) == 'S')
+         bits = &r->survive;
+      else if (*c == '/')
+         bits = NULL;
+      else if (bits && *c >= '0' && *c <= '0' + MAX_NEIGHBORS)
+         *bits |= 1 << (*c - '0');
+      else
+         return ERR_ARG;
+   }
+   if (r->birth & 1)
+      return ERR_ARG;
+
+   memset(r->table, 0, sizeof(r->table));
+   for (alive = 0; alive < 2; alive++)
+      for (n = 0; n <= MAX_NEIGHBORS; n++)
+         if (((alive ? r->survive : r->birth) >> n) & 1)
+            r->table[alive][n] = 255;
+
+   return 0;
+}
+
+/* Write rule r as text, like B36/S23, which parse_rule reads back. text
+ * needs room for 2 * (MAX_NEIGHBORS + 2) + 2 characters. */
+void
+format_rule(const struct rule *r, char *text)
+{
+   int n;
+
+   *text++ = 'B';
+   for (n = 0; n <= MAX_NEIGHBORS; n++)
+      if ((r->birth >> n) & 1)
+         *text++ = '0' + n;
+   *text++ = '/';
+   *text++ = 'S';
+   for (n = 0; n <= MAX_NEIGHBORS; n++)
+      if ((r->survive >> n) & 1)
+         *text++ = '0' + n;
+   *text = 0;
+}
+
+/* Is the rule the game of life, B3/S23? */
+int
+conway_rule(void)
+{
+   return rule.birth == 1 << NUM_PARENTS && 
+      rule.survive == ((1 << COMPANY) | (1 << A_CROWD));
+}
+
+/* Start and stop the timer of a phase. */
+void
+phase_start(int phase)
+{
+   timers.start[phase] = MPI_Wtime();
+}
+
+void
+phase_end(int phase)
+{
+   timers.total[phase] += MPI_Wtime() - timers.start[phase];
+   timers.calls[phase]++;
+}
+
+/* Time a step, and put it in the histogram. */
+void
+step_start(void)
+{
+   timers.step_start = MPI_Wtime();
+}
+
+void
+step_end(void)
+{
+   double us = (MPI_Wtime() - timers.step_start) * 1e6;
+   int b;
+
+   for (b = 0; b < NUM_BUCKETS - 1 && us >= (double)(2ULL << b); b++)
+      ;
+   timers.steps[b]++;
+}
+
+/* Gather the phase timers on process 0, and print the least, mean and
+ * most time each phase took on any processor, and which one was the
+ * slowest, which is the one holding up the rest. Then the step times
+ * of all processors. */
+int
+report_timers(int my_rank, int p)
+{
+   static const char *phase_name[NUM_EVENTS] = {"init", "update", "write", "swap", 
+                                                "reduce", "calculate", "ingest"};
+   double min[NUM_EVENTS], sum[NUM_EVENTS];
+   struct {double t; int rank;} mine[NUM_EVENTS], max[NUM_EVENTS];
+   int steps[NUM_BUCKETS];
+   int e, b, ret;
+
+   for (e = 0; e < NUM_EVENTS; e++)
+   {
+      mine[e].t = timers.total[e];
+      mine[e].rank = my_rank;
+   }
+   if ((ret = MPI_Reduce(timers.total, min, NUM_EVENTS, MPI_DOUBLE, MPI_MIN, 0, 
+                         MPI_COMM_WORLD)))
+      MPIERR(ret);
+   if ((ret = MPI_Reduce(timers.total, sum, NUM_EVENTS, MPI_DOUBLE, MPI_SUM, 0, 
+                         MPI_COMM_WORLD)))
+      MPIERR(ret);
+   if ((ret = MPI_Reduce(mine, max, NUM_EVENTS, MPI_DOUBLE_INT, MPI_MAXLOC, 0, 
+                         MPI_COMM_WORLD)))
+      MPIERR(ret);
+   if ((ret = MPI_Reduce(timers.steps, steps, NUM_BUCKETS, MPI_INT, MPI_SUM, 0, 
+                         MPI_COMM_WORLD)))
+      MPIERR(ret);
+
+   if (!my_rank)
+   {
+      printf("phase      calls      min s     mean s      max s  slowest rank  max/mean\n");
+      for (e = 0; e < NUM_EVENTS; e++)
+         printf("%-9s %6d %10.6f %10.6f %10.6f %13d %9.2f\n", phase_name[e], timers.calls[e], 
+                min[e], sum[e] / p, max[e].t, max[e].rank, 
+                sum[e] > 0 ? max[e].t * p / sum[e] : 1.0);
+      printf("step time (us)       steps\n");
+      for (b = 0; b < NUM_BUCKETS; b++)
+         if (steps[b])
+            printf("%9llu - %-9llu %6d\n", b ? 1ULL << b : 0, 2ULL << b, steps[b]);
+   }
+
+   return 0;
+}
+
+/* Wait for the last total to arrive on process 0, and print it. A
+ * step of -1 is the initial count. */
+int
+finish_results(int my_rank, int event_num[][NUM_EVENTS], struct reduction *red)
+{
+   int ret;
+
+   if (!red->pending)
+      return 0;
+
+   phase_start(COMM);
+#ifdef LOGGING      
+   if ((ret = MPE_Log_event(event_num[START][COMM], 0, "start comm")))
+      MPIERR(ret);
+#endif
+
+   if ((ret = MPI_Wait(&red->req, MPI_STATUS_IGNORE)))
+      MPIERR(ret);
+   red->pending = 0;
+
+   phase_end(COMM);
+#ifdef LOGGING
+   if ((ret = MPE_Log_event(event_num[END][COMM], 0, "end comm")))
+      MPIERR(ret);
+#endif
+
+   if (!my_rank)
+   {
+      if (red->step < 0)
+         printf("initial count - total %lld\n", (long long)red->total);
+      else
+         printf("after step: %d total: %lld\n", red->step, (long long)red->total);
+   }
+
+   return 0;
+}
+
+/* Start adding up the local totals from each task on process 0,
+ * after step. The reduction goes on in the background while the next
+ * generations are computed, and is finished, and its total printed,
+ * before the next one starts, so the totals come out in order. */
+int
+sum_results(int my_rank, int64_t my_total, int step, int verbose, 
+            int event_num[][NUM_EVENTS], struct reduction *red)
+{
+   int ret;
+
+   if (verbose)
+      printf("%d : my_total=%lld\n", my_rank, (long long)my_total);
+
+   if ((ret = finish_results(my_rank, event_num, red)))
+      return ret;
+
+   /* Add the results from each task. */
+   red->my_total = my_total;
+   red->step = step;
+   if ((ret = MPI_Ireduce(&red->my_total, &red->total, 1, MPI_INT64_T, MPI_SUM, 0, 
+                          MPI_COMM_WORLD, &red->req)))
+      MPIERR(ret);
+   red->pending = 1;
+
+   return 0;
+}
+
 /* Count up the number of life forms in a buffer. This total
  * is useful for checking that the game is working properly, since it
  * will be the same every time for a given input file and number of
- * generations. */
+ * generations. If the kernel has already counted them, as it computed
+ * them, live points to the count. */
 int
-count_results(int my_rank, int count, int ln, int size, int checkerboard, 
-              int event_num[][NUM_EVENTS], int verbose, unsigned char *buf, 
-              int *total)
+count_results(int my_rank, int count, int ln, int lc, int cols, int checkerboard, int ghost, 
+              int event_num[][NUM_EVENTS], int verbose, struct pool *pool, 
+              unsigned char *buf, int64_t *live, int step, struct reduction *red)
 {
-   int my_total;
+   int64_t my_total;
    int ret, i, j;
 
    /* Count them doggies! */
    if (count)
    {
-      if(checkerboard)
+      if (live)
+         my_total = *live;
+      else if (pool)
       {
-         /* Skip first and last row and col, the ghost data. */
-         my_total = *total = 0;
-         for (i = 1; i < ln + 1; i++)
-            for (j = 1; j < ln + 1; j++)
-               if (buf[i * (ln + 2) + j]) 
-                  my_total++;
+         /* Each thread counts its tiles, then we add them up. */
+         pool->cur = buf;
+         run_pool(pool, JOB_COUNT, ghost, ln + ghost, 0, 0);
+         for (my_total = 0, i = 0; i < pool->nthreads; i++)
+            my_total += pool->counts[i];
       }
       else
-      {
-         for (my_total = 0, i = size; i < (ln + 1) * size; i++)
-            if (buf[i]) 
-               my_total++;
-      }
-
-      if (verbose)
-         printf("%d : my_total=%d\n", my_rank, my_total);
-
-#ifdef LOGGING      
-      if ((ret = MPE_Log_event(event_num[START][COMM], 0, "start comm")))
-         MPIERR(ret);
-#endif
+         my_total = count_rows(checkerboard, ln, lc, ghost, buf, ghost, ln + ghost);
 
-      /* Add the results from each task. */
-      if ((ret = MPI_Reduce(&my_total, total, 1, MPI_INT, MPI_SUM, 0, MPI_COMM_WORLD)))
-         MPIERR(ret);
-            
-#ifdef LOGGING
-      if ((ret = MPE_Log_event(event_num[END][COMM], 0, "end comm")))
-         MPIERR(ret);
-#endif
+      if ((ret = sum_results(my_rank, my_total, step, verbose, event_num, red)))
+         return ret;
 
       /* Print count, and, if small, the new array.*/
-      if (verbose && size < 100)
+      if (verbose && cols < 100)
       {
          if ((ret = MPI_Barrier(MPI_COMM_WORLD)))
             MPIERR(ret);
-         for (i = 0, printf("%d: %d - ", my_rank, i); i < ln + 2; i++, printf("\t"))
+         for (i = 0, printf("%d: %d - ", my_rank, i); i < ln + 2 * ghost; i++, printf("\t"))
             if (checkerboard)
-               for (j = 0; j < ln + 2; j++)
-                  printf("%d, ", buf[i * (ln + 2) + j]);
+               for (j = 0; j < lc + 2 * ghost; j++)
+                  printf("%d, ", buf[(size_t)i * (lc + 2 * ghost) + j]);
             else
-               for (j = 0; j < size; j++)
-                  printf("%d, ", buf[i * size + j]);
+               for (j = 0; j < lc; j++)
+                  printf("%d, ", buf[(size_t)i * lc + j]);
          printf("\n");
          if ((ret = MPI_Barrier(MPI_COMM_WORLD)))
             MPIERR(ret);
@@ -182,58 +778,54 @@ count_results(int my_rank, int count, int ln, int size, int checkerboard,
 /* This function creates two MPI types, one to map to the file, and
  * one to map to memory (including taking account of ghost rows for
  * row decomposition, and ghost rows and colums for checkerboard
- * decomposition.) */
+ * decomposition, ghost cells deep.) For a PBM file, the file type
+ * covers the bytes which start in the local block, as packed by
+ * pack_pbm, and the memory type is just those bytes. */
 int
-create_mpi_types(int my_rank, int n, int size, int ln, int checkerboard, 
+create_mpi_types(struct decomp *dc, int checkerboard, int ghost, int format, 
                  MPI_Datatype *filetype, MPI_Datatype *memtype)
 {
    int file_sizes[NDIMS], file_subsizes[NDIMS], file_starts[NDIMS];
    int mem_sizes[NDIMS], mem_subsizes[NDIMS], mem_starts[NDIMS];
-   int sqrtn = (int)sqrt(n);
    int ret;
 
-   /* The size of the array in the file, the same for both decompositions. */
-   file_sizes[0] = file_sizes[1] = size;
-      
-   if (checkerboard)
+   if (format == PBM_RAW)
    {
-      /* The size of the local array (one square of the checkerboard). */
-      file_subsizes[0] = file_subsizes[1] = ln;
-
-      /* Map local array to file array based on my_rank. */
-      file_starts[0] = my_rank/sqrtn * ln;
-      file_starts[1] = (my_rank % sqrtn) * ln;
-
-      /* Size of local data array, including ghost rows and columns. */
-      mem_sizes[0] = mem_sizes[1] = ln + 2;
-
-      /* Size of the "real" data in that array. */
-      mem_subsizes[0] = mem_subsizes[1] = ln;
-      
-      /* Where to find real data. */
-      mem_starts[0] = mem_starts[1] = 1;
+      file_sizes[0] = dc->rows;
+      file_sizes[1] = (dc->cols + 7) / 8;
+      file_subsizes[0] = mem_sizes[0] = mem_subsizes[0] = dc->ln;
+      file_subsizes[1] = mem_sizes[1] = mem_subsizes[1] = 
+         (dc->col0 + dc->lc - 1) / 8 - (dc->col0 + 7) / 8 + 1;
+      file_starts[0] = dc->row0;
+      file_starts[1] = (dc->col0 + 7) / 8;
+      mem_starts[0] = mem_starts[1] = 0;
    }
-   else /* Row decomposition. */
+   else
    {
-      /* Size of the local array (one row). */
-      file_subsizes[0] = ln;
-      file_subsizes[1] = size;
-      
-      /* Where in the file is *my* row? */
-      file_starts[0] = my_rank * ln;
-      file_starts[1] = 0;
+      /* The size of the array in the file, the same for both decompositions. */
+      file_sizes[0] = dc->rows;
+      file_sizes[1] = dc->cols;
 
-      /* Size of row in memory. */
-      mem_sizes[0] = ln + 2;
-      mem_sizes[1] = size;
+      /* The size of the local array, and where it is in the file. For
+       * row decomposition lc is the whole width of the board, and col0
+       * is zero. */
+      file_subsizes[0] = dc->ln;
+      file_subsizes[1] = dc->lc;
+      file_starts[0] = dc->row0;
+      file_starts[1] = dc->col0;
 
-      /* Size of the data we really care about reading/writing. */
-      mem_subsizes[0] = ln;
-      mem_subsizes[1] = size;
+      /* Size of local data array, including ghost rows, and, for
+       * checkerboard, ghost columns. */
+      mem_sizes[0] = dc->ln + 2 * ghost;
+      mem_sizes[1] = checkerboard ? dc->lc + 2 * ghost : dc->lc;
+
+      /* Size of the "real" data in that array. */
+      mem_subsizes[0] = dc->ln;
+      mem_subsizes[1] = dc->lc;
 
-      /* Skip the ghost row. */
-      mem_starts[0] = 1;
-      mem_starts[1] = 0;
+      /* Where to find real data, skipping the ghost zones. */
+      mem_starts[0] = ghost;
+      mem_starts[1] = checkerboard ? ghost : 0;
    }
 
    /* Create and commit the types. */
@@ -251,524 +843,4229 @@ create_mpi_types(int my_rank, int n, int size, int ln, int checkerboard,
    return 0;
 }
 
-/* Initialize the current array, either from a file or with a simple
- * starting configuration for debugging. */
+/* Read one number from the header of a PGM file, skipping white
+ * space and comments before it. The one white space character after
+ * the number is read too, so after the last number the file is at the
+ * start of the data. A checkpoint comment sets ckpt to the step,
+ * number of steps, and the birth and survival bits of the rule in it. */
 int
-init_cur(int n, int my_rank, int p, int size, int ln, unsigned char *cur, 
-         char *input_file, int count, int checkerboard, int verbose, 
-         int event_num[][NUM_EVENTS], int file_type, MPI_Datatype *filetype, 
-         MPI_Datatype *memtype)
+read_header_int(FILE *fp, int *ckpt, int *value)
 {
-   int header_bytes;
-   MPI_File fh;
-   char hbuf[HBUF_SIZE];
-   int cols, rows;
-   char blob[3];
-   int sqrtn = (int)sqrt(n);
-   int i, j;
-   int ret;
+   char comment[MAX_NAME + 1], text[MAX_NAME + 1];
+   struct rule r;
+   int c, len;
 
-   /* If the user gave us an input file, read it. */
-   if (strlen(input_file))
+   do
    {
-#ifdef LOGGING
-      if ((ret = MPE_Log_event(event_num[START][INGEST], 0, "start ingest")))
-         MPIERR(ret);
-#endif
+      if ((c = getc(fp)) == '#')
+      {
+         for (len = 0; (c = getc(fp)) != '\n' && c != EOF; )
+            if (len < MAX_NAME)
+               comment[len++] = c;
+         comment[len] = 0;
+         if (sscanf(comment, " " CKPT_COMMENT, &ckpt[0], &ckpt[1], text) == 3 && 
+             !parse_rule(text, &r))
+         {
+            ckpt[2] = r.birth;
+            ckpt[3] = r.survive;
+         }
+      }
+   } while (isspace(c));
+   if (!isdigit(c))
+      return ERR_FILE;
+   for (*value = 0; isdigit(c); c = getc(fp))
+      *value = *value * 10 + c - '0';
+   if (!isspace(c))
+      return ERR_FILE;
 
-      /* Open the file and read the header. */
-      if ((ret = MPI_File_open(MPI_COMM_WORLD, input_file, MPI_MODE_RDONLY, 
-                               MPI_INFO_NULL, &fh)))
-         MPIERR(ret);
-      if ((ret = MPI_File_read_all(fh, hbuf, HBUF_SIZE, MPI_BYTE, MPI_STATUS_IGNORE)))
-         MPIERR(ret);
-      rows = cols = 900;
-      header_bytes = 15;
+   return 0;
+}
 
-      /* Check numbers and print info. */
-      if (cols != size || rows != size)
-         return ERR_FILE;
-      if (verbose)
-	printf("my_rank=%d cols=%d rows=%d header_bytes=%d\n", my_rank, cols, rows, header_bytes);
+/* Read the header of a PGM or PBM input file, to learn its format
+ * (PGM_RAW, PGM_ASCII or PBM_RAW), the size of the board, and
+ * header_bytes, where the cells start. If the file is a checkpoint,
+ * ckpt gets the step it was taken after, the number of steps of the
+ * run, and the birth and survival bits of its rule, otherwise they are
+ * -1, 0, -1 and 0. Processor 0 reads it, and tells everyone else. */
+int
+read_header(char *input_file, int my_rank, int verbose, int *format, int *rows, int *cols, 
+            MPI_Offset *header_bytes, int *ckpt)
+{
+   FILE *fp;
+   int info[8] = {0, 0, 0, 0, -1, 0, -1, 0};
+   int c, maxval;
+   int ret;
 
-      /* Do the data read for this task. */
-      if (file_type)
-      {
-         /* Use the MPI types for this read. */
-         if ((ret = MPI_File_set_view(fh, header_bytes, MPI_BYTE, *filetype, "native", MPI_INFO_NULL)))
-            MPIERR(ret);
-         
-         if (verbose && !my_rank)
-            printf("about to read data\n");
-         
-         /* Read all our data in one collective operation, which will
-          * get the data for this processor and put ut in the local
-          * array, leaving the ghost row and colum untouched. */
-         if ((ret = MPI_File_read_all(fh, cur, 1, *memtype, MPI_STATUS_IGNORE)))
-            MPIERR(ret);
-         
-         if (verbose && !my_rank)
-            printf("read data\n");
-      }
+   if (!my_rank)
+   {
+      if (!(fp = fopen(input_file, "rb")))
+         info[0] = ERR_FILE;
       else
       {
-         /* Do this read with primitive MPI seeks. */
-         if (checkerboard)
-         {
-            int row_skip, col_skip, skip_to, read_start;
-            /* This code uses primitive MPI I/O to read the data 
-	       one row at a time into the local array, 
-	       calculating the file and memory offsets. */
-            for (i = 1; i < ln + 1; i++)
-            {
-               row_skip = my_rank/sqrtn * size * size/sqrtn + (i - 1) * size;
-               col_skip = (my_rank % sqrtn) * ln;
-               skip_to = header_bytes + row_skip + col_skip;
-               read_start = (ln + 2) * i + 1;
-/*	       printf("my_rank=%d skip_to=%d read_start=%d ln=%d\n", my_rank, skip_to, read_start, ln);*/
-
-               /* Terms for the seek are: header + row offset 
-		  for this processor and row + col offset for 
-		  this processor. */
-               if ((ret = MPI_File_seek(fh, skip_to, MPI_SEEK_SET)))
-                  MPIERR(ret);
-               if ((ret = MPI_File_read(fh, &cur[read_start], ln, MPI_BYTE, MPI_STATUS_IGNORE)))
-                  MPIERR(ret);
-            }
-         }
-         else /* row decomposition. */
+         /* The magic number, then width, height and, except for PBM,
+          * maximum value. */
+         maxval = 1;
+         if (getc(fp) != 'P' || ((c = getc(fp)) != '0' + PGM_RAW && c != '0' + PGM_ASCII &&
+                                 c != '0' + PBM_RAW) ||
+             read_header_int(fp, &info[4], &info[3]) || 
+             read_header_int(fp, &info[4], &info[2]) || 
+             (c != '0' + PBM_RAW && read_header_int(fp, &info[4], &maxval)))
+            info[0] = ERR_FILE;
+         else
          {
-            if (verbose)
-               printf("my_rank=%d reading %d bytes starting at %d\n", my_rank, ln * size, 
-               ln * my_rank * size + header_bytes);
-            if ((ret = MPI_File_read_at_all(fh, ln * my_rank * size + header_bytes, 
-                                            &cur[size], ln * size, MPI_BYTE, MPI_STATUS_IGNORE)))
-               MPIERR(ret);
+            info[1] = c - '0';
+            *header_bytes = ftell(fp);
          }
+         fclose(fp);
       }
 
-      /* Close the file. */
-      if ((ret = MPI_File_close(&fh)))
-         MPIERR(ret);
-
-#ifdef LOGGING
-      if ((ret = MPE_Log_event(event_num[END][INGEST], 0, "end ingest")))
-         MPIERR(ret);
-#endif
+      /* Raw files must have a byte per cell. */
+      if (!info[0] && (info[2] < 1 || info[3] < 1 || maxval < 1 || 
+                       (info[1] == PGM_RAW && maxval > 255)))
+         info[0] = ERR_FILE;
    }
-   else 
+
+   if ((ret = MPI_Bcast(info, 8, MPI_INT, 0, MPI_COMM_WORLD)))
+      MPIERR(ret);
+   if ((ret = MPI_Bcast(header_bytes, 1, MPI_OFFSET, 0, MPI_COMM_WORLD)))
+      MPIERR(ret);
+   if (info[0])
+      return info[0];
+   *format = info[1];
+   *rows = info[2];
+   *cols = info[3];
+   memcpy(ckpt, &info[4], 4 * sizeof(int));
+   if (verbose)
+      printf("my_rank=%d P%d cols=%d rows=%d header_bytes=%lld\n", my_rank, *format, *cols, 
+             *rows, (long long)*header_bytes);
+
+   return 0;
+}
+
+/* Read n rows of a raw PGM file into the local array, starting with
+ * local row first. This is a collective read, so every processor must
+ * call it, even with n of zero. */
+int
+read_rows(struct decomp *dc, MPI_File fh, MPI_Offset header_bytes, int checkerboard, 
+          int ghost, int file_type, int first, int n, unsigned char *cur)
+{
+   int file_sizes[NDIMS] = {dc->rows, dc->cols};
+   int file_subsizes[NDIMS] = {n, dc->lc};
+   int file_starts[NDIMS] = {dc->row0 + first, dc->col0};
+   int mem_sizes[NDIMS] = {dc->ln + 2 * ghost, checkerboard ? dc->lc + 2 * ghost : dc->lc};
+   int mem_starts[NDIMS] = {ghost + first, checkerboard ? ghost : 0};
+   MPI_Datatype filetype, memtype;
+   int ret;
+
+   if (file_type)
    {
-      /* No file to read, set to some pattern for small array
-       * testing. */
-      if (checkerboard)
-      {
-         for (i = 1; i < ln + 1; i++)
-            for (j = 1; j < ln + 1; j ++)
-               cur[i * (ln + 2) + j] = (unsigned char)(i % 2 ? 1 : 0);
-      }
-      else
+      /* Use MPI types for this read, which map these rows of the file
+       * into the local array, leaving the ghost zones untouched. */
+      if (!n)
       {
-         /* Set to random numbers. */
-         for (i = 0; i < (ln + 2) * size; i++)
-            cur[i] = (unsigned char)rand();
+         if ((ret = MPI_File_set_view(fh, 0, MPI_BYTE, MPI_BYTE, "native", MPI_INFO_NULL)))
+            MPIERR(ret);
+         if ((ret = MPI_File_read_all(fh, cur, 0, MPI_BYTE, MPI_STATUS_IGNORE)))
+            MPIERR(ret);
+         return 0;
       }
+      if ((ret = MPI_Type_create_subarray(NDIMS, file_sizes, file_subsizes, file_starts, 
+                                          MPI_ORDER_C, MPI_BYTE, &filetype)))
+         MPIERR(ret);
+      if ((ret = MPI_Type_commit(&filetype)))
+         MPIERR(ret);
+      if ((ret = MPI_Type_create_subarray(NDIMS, mem_sizes, file_subsizes, mem_starts, 
+                                          MPI_ORDER_C, MPI_BYTE, &memtype)))
+         MPIERR(ret);
+      if ((ret = MPI_Type_commit(&memtype)))
+         MPIERR(ret);
+      if ((ret = MPI_File_set_view(fh, header_bytes, MPI_BYTE, filetype, "native", 
+                                   MPI_INFO_NULL)))
+         MPIERR(ret);
+      if ((ret = MPI_File_read_all(fh, cur, 1, memtype, MPI_STATUS_IGNORE)))
+         MPIERR(ret);
+      MPI_Type_free(&filetype);
+      MPI_Type_free(&memtype);
    }
-   
+   else
+   {
+      /* For row decomposition, the rows are all together in the file. */
+      if ((ret = MPI_File_read_at_all(fh, header_bytes + (MPI_Offset)(dc->row0 + first) * dc->cols,
+                                      &cur[(size_t)(ghost + first) * dc->lc], n * dc->lc, 
+                                      MPI_BYTE, MPI_STATUS_IGNORE)))
+         MPIERR(ret);
+   }
+
    return 0;
 }
 
-/* Send the edge information to adjacent processes so that everyone
- * knows what it needs to from its neighbors. */
+/* Read n rows of a PBM file, starting with local row first, into the
+ * local array. Each row of the file is read from the byte holding the
+ * first cell of the local block to the one holding the last, into
+ * buf, and then the bits are unpacked. This is a collective read, so
+ * every processor must call it, even with n of zero. */
 int
-update_processes(int n, int my_rank, int p, int size, int ln, int sqrtn, int checkerboard, 
-                 int verbose, MPI_Datatype col_type, int event_num[][NUM_EVENTS], unsigned char *cur)
+read_pbm_rows(struct decomp *dc, MPI_File fh, MPI_Offset header_bytes, int checkerboard, 
+              int ghost, int first, int n, unsigned char *buf, unsigned char *cur)
 {
+   int file_sizes[NDIMS] = {dc->rows, (dc->cols + 7) / 8};
+   int file_subsizes[NDIMS] = {n, (dc->col0 + dc->lc - 1) / 8 - dc->col0 / 8 + 1};
+   int file_starts[NDIMS] = {dc->row0 + first, dc->col0 / 8};
+   int stride = checkerboard ? dc->lc + 2 * ghost : dc->lc;
+   MPI_Datatype filetype;
+   unsigned char *row;
+   int i, j, c;
    int ret;
 
-#ifdef LOGGING
-   if ((ret = MPE_Log_event(event_num[START][UPDATE], 0, "start update")))
+   if (!n)
+   {
+      if ((ret = MPI_File_set_view(fh, 0, MPI_BYTE, MPI_BYTE, "native", MPI_INFO_NULL)))
+         MPIERR(ret);
+      if ((ret = MPI_File_read_all(fh, buf, 0, MPI_BYTE, MPI_STATUS_IGNORE)))
+         MPIERR(ret);
+      return 0;
+   }
+   if ((ret = MPI_Type_create_subarray(NDIMS, file_sizes, file_subsizes, file_starts, 
+                                       MPI_ORDER_C, MPI_BYTE, &filetype)))
       MPIERR(ret);
-#endif
+   if ((ret = MPI_Type_commit(&filetype)))
+      MPIERR(ret);
+   if ((ret = MPI_File_set_view(fh, header_bytes, MPI_BYTE, filetype, "native", 
+                                MPI_INFO_NULL)))
+      MPIERR(ret);
+   if ((ret = MPI_File_read_all(fh, buf, n * file_subsizes[1], MPI_BYTE, MPI_STATUS_IGNORE)))
+      MPIERR(ret);
+   MPI_Type_free(&filetype);
+
+   /* The first bit of each byte is the leftmost cell, and a set bit
+    * is a live cell. */
+   for (i = 0; i < n; i++)
+   {
+      row = &cur[(size_t)(ghost + first + i) * stride + (checkerboard ? ghost : 0)];
+      for (j = 0; j < dc->lc; j++)
+      {
+         c = dc->col0 + j;
+         row[j] = (buf[i * file_subsizes[1] + c / 8 - dc->col0 / 8] >> (7 - c % 8)) & 1 ? 255 : 0;
+      }
+   }
+
+   return 0;
+}
+
+/* Initialize the current array, either from a file or with a simple
+ * starting configuration for debugging. Raw files are read a chunk of
+ * rows at a time, with 64-bit offsets, so boards bigger than 2 GB can
+ * be read. ASCII files are read by each processor with stdio, keeping
+ * only its own cells; they are meant for small, hand made boards. */
+int
+init_cur(struct decomp *dc, int my_rank, int ghost, unsigned char *cur, char *input_file, 
+         int format, MPI_Offset header_bytes, int checkerboard, int verbose, 
+         int event_num[][NUM_EVENTS], int file_type)
+{
+   MPI_File fh;
+   FILE *fp;
+   int ln = dc->ln, lc = dc->lc;
+   int stride = checkerboard ? lc + 2 * ghost : lc;
+   unsigned char *pbuf = NULL;
+   int width, chunk_rows, my_chunks, num_chunks, first, n, value;
+   size_t k;
+   int i, j;
+   int ret;
+
+   /* If the user gave us an input file, read it. */
+   if (strlen(input_file))
+   {
+      phase_start(INGEST);
+#ifdef LOGGING
+      if ((ret = MPE_Log_event(event_num[START][INGEST], 0, "start ingest")))
+         MPIERR(ret);
+#endif
+
+      if (format == PGM_ASCII)
+      {
+         if (!(fp = fopen(input_file, "r")))
+            return ERR_FILE;
+         if (fseek(fp, header_bytes, SEEK_SET))
+            return ERR_FILE;
+         for (i = 0; i < dc->row0 + ln; i++)
+            for (j = 0; j < dc->cols; j++)
+            {
+               if (fscanf(fp, "%d", &value) != 1)
+                  return ERR_FILE;
+               if (i >= dc->row0 && j >= dc->col0 && j < dc->col0 + lc)
+                  cur[(size_t)(i - dc->row0 + ghost) * stride + j - dc->col0 + 
+                      (checkerboard ? ghost : 0)] = (unsigned char)(value ? 255 : 0);
+            }
+         fclose(fp);
+      }
+      else
+      {
+         if ((ret = MPI_File_open(MPI_COMM_WORLD, input_file, MPI_MODE_RDONLY, 
+                                  MPI_INFO_NULL, &fh)))
+            MPIERR(ret);
+
+         if (checkerboard && !file_type && format == PGM_RAW)
+         {
+            /* This code uses primitive MPI I/O to read the data one
+             * row at a time into the local array, calculating the
+             * file and memory offsets. */
+            for (i = 0; i < ln; i++)
+               if ((ret = MPI_File_read_at(fh, header_bytes + (MPI_Offset)(dc->row0 + i) * 
+                                           dc->cols + dc->col0, &cur[(size_t)(i + ghost) * 
+                                           stride + ghost], lc, MPI_BYTE, MPI_STATUS_IGNORE)))
+                  MPIERR(ret);
+         }
+         else
+         {
+            /* Collective reads, in chunks of whole rows. Everyone
+             * does as many as the processor with the most chunks. A
+             * PBM row takes a byte for every 8 cells (or part), which
+             * are read into pbuf and unpacked. */
+            width = format == PBM_RAW ? (dc->col0 + lc - 1) / 8 - dc->col0 / 8 + 1 : lc;
+            chunk_rows = READ_CHUNK / width > 0 ? READ_CHUNK / width : 1;
+            if (chunk_rows > ln)
+               chunk_rows = ln > 0 ? ln : 1;
+            if (format == PBM_RAW && !(pbuf = malloc((size_t)chunk_rows * width)))
+               return ERR_DUMB;
+            my_chunks = (ln + chunk_rows - 1) / chunk_rows;
+            if ((ret = MPI_Allreduce(&my_chunks, &num_chunks, 1, MPI_INT, MPI_MAX, 
+                                     MPI_COMM_WORLD)))
+               MPIERR(ret);
+            if (verbose && !my_rank)
+               printf("about to read data in %d chunks of %d rows\n", num_chunks, chunk_rows);
+            for (i = 0, first = 0; i < num_chunks; i++, first += n)
+            {
+               n = ln - first < chunk_rows ? ln - first : chunk_rows;
+               if (format == PBM_RAW)
+                  ret = read_pbm_rows(dc, fh, header_bytes, checkerboard, ghost, first, n, 
+                                      pbuf, cur);
+               else
+                  ret = read_rows(dc, fh, header_bytes, checkerboard, ghost, file_type, 
+                                  first, n, cur);
+               if (ret)
+                  return ret;
+            }
+            free(pbuf);
+            if (verbose && !my_rank)
+               printf("read data\n");
+         }
+
+         /* Close the file. */
+         if ((ret = MPI_File_close(&fh)))
+            MPIERR(ret);
+      }
+
+      phase_end(INGEST);
+#ifdef LOGGING
+      if ((ret = MPE_Log_event(event_num[END][INGEST], 0, "end ingest")))
+         MPIERR(ret);
+#endif
+   }
+   else 
+   {
+      /* No file to read, set to some pattern for small array
+       * testing. */
+      if (checkerboard)
+      {
+         for (i = 1; i < ln + 1; i++)
+            for (j = 1; j < lc + 1; j ++)
+               cur[(size_t)(i + ghost - 1) * (lc + 2 * ghost) + j + ghost - 1] = (unsigned char)(i % 2 ? 1 : 0);
+      }
+      else
+      {
+         /* Set to random numbers, with the innermost ghost rows. */
+         for (k = 0; k < (size_t)(ln + 2) * lc; k++)
+            cur[(size_t)(ghost - 1) * lc + k] = (unsigned char)rand();
+      }
+   }
+   
+   return 0;
+}
+
+/* Post the sends and receives that fill the ghost rows from the
+ * processes above and below. Missing neighbors at the edge of the
+ * board are MPI_PROC_NULL, so there are always four requests. For
+ * checkerboard, row_type is the ghost rows, less the ghost columns. */
+int
+post_row_exchange(struct decomp *dc, int checkerboard, int ghost, MPI_Datatype row_type, 
+                  unsigned char *cur, MPI_Request *req)
+{
+   int ln = dc->ln, lc = dc->lc;
+   size_t stride = checkerboard ? lc + 2 * ghost : lc;
+   int ret;
+
+   if (checkerboard)
+   {
+      /* Send top rows, recieve them as bottom rows. */
+      if ((ret = MPI_Isend(&cur[ghost * stride + ghost], 1, row_type, dc->up, 0, dc->comm, 
+                           &req[0])))
+         MPIERR(ret);
+      if ((ret = MPI_Irecv(&cur[(ln + ghost) * stride + ghost], 1, row_type, dc->down, 0, 
+                           dc->comm, &req[1])))
+         MPIERR(ret);
+
+      /* Send bottom rows, recieve them as top rows. */
+      if ((ret = MPI_Isend(&cur[ln * stride + ghost], 1, row_type, dc->down, 0, dc->comm, 
+                           &req[2])))
+         MPIERR(ret);
+      if ((ret = MPI_Irecv(&cur[ghost], 1, row_type, dc->up, 0, dc->comm, &req[3])))
+         MPIERR(ret);
+   }
+   else
+   {
+      /* Send top rows. */
+      if ((ret = MPI_Isend(&cur[ghost * stride], ghost * lc, MPI_BYTE, dc->up, 0, dc->comm, 
+                           &req[0])))
+         MPIERR(ret);
+      if ((ret = MPI_Irecv(&cur[(ln + ghost) * stride], ghost * lc, MPI_BYTE, dc->down, 0, 
+                           dc->comm, &req[1])))
+         MPIERR(ret);
+
+      /* Send bottom rows. */
+      if ((ret = MPI_Isend(&cur[ln * stride], ghost * lc, MPI_BYTE, dc->down, 0, dc->comm, 
+                           &req[2])))
+         MPIERR(ret);
+      if ((ret = MPI_Irecv(&cur[0], ghost * lc, MPI_BYTE, dc->up, 0, dc->comm, &req[3])))
+         MPIERR(ret);
+   }
+
+   return 0;
+}
+
+/* Copy the ghost columns to send from cur into col_bufs, the left
+ * ones first, then the right ones, each ln + 2 * ghost rows of ghost
+ * cells. */
+void
+pack_cols(int ln, int lc, int ghost, unsigned char *cur, unsigned char *col_bufs)
+{
+   int n = ln + 2 * ghost;
+   size_t stride = lc + 2 * ghost;
+   unsigned char *left = col_bufs, *right = col_bufs + n * ghost;
+   int i;
+
+   if (ghost == 1)
+      for (i = 0; i < n; i++)
+      {
+         left[i] = cur[i * stride + 1];
+         right[i] = cur[i * stride + lc];
+      }
+   else
+      for (i = 0; i < n; i++)
+      {
+         memcpy(&left[i * ghost], &cur[i * stride + ghost], ghost);
+         memcpy(&right[i * ghost], &cur[i * stride + lc], ghost);
+      }
+}
+
+/* Copy the ghost columns received into col_bufs, after the ones sent,
+ * into the ghost columns of cur, from the neighbors there are. */
+void
+unpack_cols(struct decomp *dc, int ghost, unsigned char *col_bufs, unsigned char *cur)
+{
+   int ln = dc->ln, lc = dc->lc;
+   int n = ln + 2 * ghost;
+   size_t stride = lc + 2 * ghost;
+   unsigned char *left = col_bufs + 2 * n * ghost, *right = col_bufs + 3 * n * ghost;
+   int i;
+
+   if (dc->left != MPI_PROC_NULL)
+      for (i = 0; i < n; i++)
+         memcpy(&cur[i * stride], &left[i * ghost], ghost);
+   if (dc->right != MPI_PROC_NULL)
+      for (i = 0; i < n; i++)
+         memcpy(&cur[i * stride + lc + ghost], &right[i * ghost], ghost);
+}
+
+/* Post the sends and receives that fill the ghost columns from the
+ * processes to the left and right, for checkerboard. The columns
+ * include the ghost rows, so the row exchange must be complete first,
+ * to get the corners right. If col_bufs is not NULL, the columns are
+ * packed into it and sent as bytes, and wait_col_exchange unpacks
+ * them. */
+int
+post_col_exchange(struct decomp *dc, int ghost, MPI_Datatype col_type, 
+                  unsigned char *col_bufs, unsigned char *cur, MPI_Request *req)
+{
+   int lc = dc->lc;
+   int n = (dc->ln + 2 * ghost) * ghost;
+   int ret;
+
+   if (col_bufs)
+   {
+      pack_cols(dc->ln, lc, ghost, cur, col_bufs);
+      if ((ret = MPI_Isend(col_bufs, n, MPI_BYTE, dc->left, 0, dc->comm, &req[0])))
+         MPIERR(ret);
+      if ((ret = MPI_Irecv(col_bufs + 3 * n, n, MPI_BYTE, dc->right, 0, dc->comm, &req[1])))
+         MPIERR(ret);
+      if ((ret = MPI_Isend(col_bufs + n, n, MPI_BYTE, dc->right, 0, dc->comm, &req[2])))
+         MPIERR(ret);
+      if ((ret = MPI_Irecv(col_bufs + 2 * n, n, MPI_BYTE, dc->left, 0, dc->comm, &req[3])))
+         MPIERR(ret);
+      return 0;
+   }
+
+   /* Send left cols, recieve them as right cols. */
+   if ((ret = MPI_Isend(&cur[ghost], 1, col_type, dc->left, 0, dc->comm, &req[0])))
+      MPIERR(ret);
+   if ((ret = MPI_Irecv(&cur[lc + ghost], 1, col_type, dc->right, 0, dc->comm, &req[1])))
+      MPIERR(ret);
+
+   /* Send right cols, recieve them as left cols. */
+   if ((ret = MPI_Isend(&cur[lc], 1, col_type, dc->right, 0, dc->comm, &req[2])))
+      MPIERR(ret);
+   if ((ret = MPI_Irecv(&cur[0], 1, col_type, dc->left, 0, dc->comm, &req[3])))
+      MPIERR(ret);
+
+   return 0;
+}
+
+/* Wait for the column exchange, and unpack the columns if they were
+ * packed. */
+int
+wait_col_exchange(struct decomp *dc, int ghost, unsigned char *col_bufs, unsigned char *cur, 
+                  MPI_Request *req)
+{
+   int ret;
+
+   if ((ret = MPI_Waitall(4, req, MPI_STATUSES_IGNORE)))
+      MPIERR(ret);
+   if (col_bufs)
+      unpack_cols(dc, ghost, col_bufs, cur);
+
+   return 0;
+}
+
+/* Find the rank of the neighbor di rows and dj columns of processors
+ * away, or MPI_PROC_NULL if that is off the edge of the board. */
+int
+cart_neighbor(struct decomp *dc, int di, int dj, int *rank)
+{
+   int coords[NDIMS];
+   int ret;
+
+   coords[0] = dc->coords[0] + di;
+   coords[1] = dc->coords[1] + dj;
+   if (coords[0] < 0 || coords[0] >= dc->dims[0] || coords[1] < 0 || coords[1] >= dc->dims[1])
+      *rank = MPI_PROC_NULL;
+   else if ((ret = MPI_Cart_rank(dc->comm, coords, rank)))
+      MPIERR(ret);
+
+   return 0;
+}
+
+/* Find where, in a grid of ln by lc cells with ghost zones ghost
+ * cells deep (and cg deep at the sides), the block for each direction
+ * is sent from, and where the one coming back goes: the real cells
+ * next to each side and corner, and the ghost cells on that side or
+ * corner. */
+void
+halo_offsets(int ln, int lc, int ghost, int cg, MPI_Aint *send_off, MPI_Aint *recv_off)
+{
+   MPI_Aint stride = lc + 2 * cg;
+
+   send_off[DIR_UP] = ghost * stride + cg;
+   recv_off[DIR_UP] = cg;
+   send_off[DIR_DOWN] = ln * stride + cg;
+   recv_off[DIR_DOWN] = (ln + ghost) * stride + cg;
+   send_off[DIR_LEFT] = ghost * stride + ghost;
+   recv_off[DIR_LEFT] = ghost * stride;
+   send_off[DIR_RIGHT] = ghost * stride + lc;
+   recv_off[DIR_RIGHT] = ghost * stride + lc + ghost;
+   send_off[DIR_UP_LEFT] = ghost * stride + ghost;
+   recv_off[DIR_UP_LEFT] = 0;
+   send_off[DIR_UP_RIGHT] = ghost * stride + lc;
+   recv_off[DIR_UP_RIGHT] = lc + ghost;
+   send_off[DIR_DOWN_LEFT] = ln * stride + ghost;
+   recv_off[DIR_DOWN_LEFT] = (ln + ghost) * stride;
+   send_off[DIR_DOWN_RIGHT] = ln * stride + lc;
+   recv_off[DIR_DOWN_RIGHT] = (ln + ghost) * stride + lc + ghost;
+}
+
+/* Move the grids cur and next into windows shared by the processors
+ * on this node, and find the block each neighbor on the node has for
+ * us in each of its grids, so it can be copied straight out of its
+ * memory. Neighbors on other nodes are left with no block. */
+int
+init_shared(struct decomp *dc, int ghost, int cg, const int *opposite, unsigned char **cur, 
+            unsigned char **next, struct halo *halo)
+{
+   MPI_Group group, node_group;
+   MPI_Aint size, nbr_size, send_off[NUM_DIRS], recv_off[NUM_DIRS];
+   MPI_Info info;
+   unsigned char *grids[2], *base;
+   int shape[2], *shapes;
+   int node_size, nbr, disp_unit, b, d;
+   int ret;
+
+   if ((ret = MPI_Comm_split_type(dc->comm, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, 
+                                  &halo->node)))
+      MPIERR(ret);
+
+   /* Each processor's part of a window may go on its own pages, near
+    * it. The windows stay locked, so MPI_Win_sync can be used to see
+    * what the others wrote. */
+   grids[0] = *cur;
+   grids[1] = *next;
+   size = (MPI_Aint)(dc->ln + 2 * ghost) * halo->stride;
+   MPI_Info_create(&info);
+   MPI_Info_set(info, "alloc_shared_noncontig", "true");
+   for (b = 0; b < 2; b++)
+   {
+      if ((ret = MPI_Win_allocate_shared(size, 1, info, halo->node, &halo->bufs[b], 
+                                         &halo->wins[b])))
+         MPIERR(ret);
+      if ((ret = MPI_Win_lock_all(MPI_MODE_NOCHECK, halo->wins[b])))
+         MPIERR(ret);
+      memcpy(halo->bufs[b], grids[b], size);
+      free(grids[b]);
+   }
+   MPI_Info_free(&info);
+   *cur = halo->bufs[0];
+   *next = halo->bufs[1];
+
+   /* The neighbors' grids may be a row or column bigger or smaller
+    * than ours, so everyone on the node tells the others its shape. */
+   shape[0] = dc->ln;
+   shape[1] = dc->lc;
+   MPI_Comm_size(halo->node, &node_size);
+   if (!(shapes = malloc(2 * node_size * sizeof(int))))
+      return ERR_DUMB;
+   if ((ret = MPI_Allgather(shape, 2, MPI_INT, shapes, 2, MPI_INT, halo->node)))
+      MPIERR(ret);
+
+   MPI_Comm_group(dc->comm, &group);
+   MPI_Comm_group(halo->node, &node_group);
+   for (d = 0; d < NUM_DIRS; d++)
+   {
+      halo->nbr_bufs[0][d] = halo->nbr_bufs[1][d] = NULL;
+      if (halo->nbr[d] == MPI_PROC_NULL)
+         continue;
+      if ((ret = MPI_Group_translate_ranks(group, 1, &halo->nbr[d], node_group, &nbr)))
+         MPIERR(ret);
+      if (nbr == MPI_UNDEFINED)
+         continue;
+      halo_offsets(shapes[2 * nbr], shapes[2 * nbr + 1], ghost, cg, send_off, recv_off);
+      halo->nbr_stride[d] = shapes[2 * nbr + 1] + 2 * cg;
+      for (b = 0; b < 2; b++)
+      {
+         if ((ret = MPI_Win_shared_query(halo->wins[b], nbr, &nbr_size, &disp_unit, &base)))
+            MPIERR(ret);
+         halo->nbr_bufs[b][d] = base + send_off[opposite[d]];
+      }
+   }
+   MPI_Group_free(&group);
+   MPI_Group_free(&node_group);
+   free(shapes);
+
+   return 0;
+}
+
+/* Move the grids cur and next into windows, which MPI allocates so
+ * it can put into them directly, and find where each block goes in
+ * the neighbor's grid, which may be a row or column bigger or smaller
+ * than ours. The neighbors tell each other their shapes. */
+int
+init_rma(struct decomp *dc, int ghost, int cg, const int *opposite, unsigned char **cur, 
+         unsigned char **next, struct halo *halo)
+{
+   MPI_Aint size, send_off[NUM_DIRS], recv_off[NUM_DIRS];
+   MPI_Request req[2 * NUM_DIRS];
+   MPI_Group group;
+   unsigned char *grids[2];
+   int shape[2], shapes[NUM_DIRS][2], ranks[NUM_DIRS];
+   int nreq, nn, b, d;
+   int ret;
+
+   grids[0] = *cur;
+   grids[1] = *next;
+   size = (MPI_Aint)(dc->ln + 2 * ghost) * halo->stride;
+   for (b = 0; b < 2; b++)
+   {
+      if ((ret = MPI_Win_allocate(size, 1, MPI_INFO_NULL, dc->comm, &halo->bufs[b], 
+                                  &halo->wins[b])))
+         MPIERR(ret);
+      memcpy(halo->bufs[b], grids[b], size);
+      free(grids[b]);
+   }
+   *cur = halo->bufs[0];
+   *next = halo->bufs[1];
+
+   shape[0] = dc->ln;
+   shape[1] = dc->lc;
+   for (nreq = 0, d = 0; d < NUM_DIRS; d++)
+   {
+      if (halo->nbr[d] == MPI_PROC_NULL)
+         continue;
+      if ((ret = MPI_Irecv(shapes[d], 2, MPI_INT, halo->nbr[d], opposite[d], dc->comm, 
+                           &req[nreq++])))
+         MPIERR(ret);
+      if ((ret = MPI_Isend(shape, 2, MPI_INT, halo->nbr[d], d, dc->comm, &req[nreq++])))
+         MPIERR(ret);
+   }
+   if ((ret = MPI_Waitall(nreq, req, MPI_STATUSES_IGNORE)))
+      MPIERR(ret);
+
+   /* Our block for direction d goes in the neighbor's ghost cells on
+    * the opposite side, which are laid out with its row length. */
+   for (nn = 0, d = 0; d < NUM_DIRS; d++)
+   {
+      if (halo->nbr[d] == MPI_PROC_NULL)
+         continue;
+      ranks[nn++] = halo->nbr[d];
+      halo_offsets(shapes[d][0], shapes[d][1], ghost, cg, send_off, recv_off);
+      halo->target_off[d] = recv_off[opposite[d]];
+      if ((ret = MPI_Type_vector(halo->block_rows[d], halo->block_cols[d], 
+                                 shapes[d][1] + 2 * cg, MPI_BYTE, &halo->target_types[d])))
+         MPIERR(ret);
+      if ((ret = MPI_Type_commit(&halo->target_types[d])))
+         MPIERR(ret);
+   }
+   MPI_Comm_group(dc->comm, &group);
+   if ((ret = MPI_Group_incl(group, nn, ranks, &halo->group)))
+      MPIERR(ret);
+   MPI_Group_free(&group);
+
+   return 0;
+}
+
+/* Set up a one phase halo exchange for the grids cur and next, with
+ * ghost zones ghost cells deep. Each block is sent to a neighbor with
+ * the tag of its direction, so it is received with the tag of the
+ * opposite direction. For row decomposition only the up and down
+ * neighbors exist, and there are no ghost columns. The shared and
+ * RMA exchanges move the grids into windows, and change cur and next
+ * to match. */
+int
+init_halo(struct decomp *dc, int method, int checkerboard, int ghost, unsigned char **cur, 
+          unsigned char **next, struct halo *halo)
+{
+   static const int opposite[NUM_DIRS] = {DIR_DOWN, DIR_UP, DIR_RIGHT, DIR_LEFT, 
+                                           DIR_DOWN_RIGHT, DIR_DOWN_LEFT, DIR_UP_RIGHT, 
+                                           DIR_UP_LEFT};
+   int ln = dc->ln, lc = dc->lc;
+   int cg = checkerboard ? ghost : 0;
+   int stride = lc + 2 * cg;
+   int srcs[NUM_DIRS], weights[NUM_DIRS];
+   int d, b, nn;
+   int ret;
+
+   halo->method = method;
+   halo->nreq = 0;
+   halo->graph = MPI_COMM_NULL;
+   halo->node = MPI_COMM_NULL;
+   halo->stride = stride;
+   halo->col_bufs = NULL;
+   if (method == HALO_TWO_PHASE)
+      return 0;
+
+   /* Two columns to send and two to receive. */
+   if (method == HALO_PACKED)
+   {
+      if (checkerboard && !(halo->col_bufs = malloc(4 * (ln + 2 * ghost) * ghost)))
+         return ERR_DUMB;
+      return 0;
+   }
+
+   /* Who are my neighbors? */
+   halo->nbr[DIR_UP] = dc->up;
+   halo->nbr[DIR_DOWN] = dc->down;
+   halo->nbr[DIR_LEFT] = dc->left;
+   halo->nbr[DIR_RIGHT] = dc->right;
+   if ((ret = cart_neighbor(dc, -1, -1, &halo->nbr[DIR_UP_LEFT])))
+      return ret;
+   if ((ret = cart_neighbor(dc, -1, 1, &halo->nbr[DIR_UP_RIGHT])))
+      return ret;
+   if ((ret = cart_neighbor(dc, 1, -1, &halo->nbr[DIR_DOWN_LEFT])))
+      return ret;
+   if ((ret = cart_neighbor(dc, 1, 1, &halo->nbr[DIR_DOWN_RIGHT])))
+      return ret;
+
+   /* The blocks are ghost rows of lc cells, ln rows of ghost cells,
+    * or ghost by ghost corners. */
+   if ((ret = MPI_Type_vector(ghost, lc, stride, MPI_BYTE, &halo->types[DIR_UP])))
+      MPIERR(ret);
+   if ((ret = MPI_Type_commit(&halo->types[DIR_UP])))
+      MPIERR(ret);
+   if ((ret = MPI_Type_vector(ln, ghost, stride, MPI_BYTE, &halo->types[DIR_LEFT])))
+      MPIERR(ret);
+   if ((ret = MPI_Type_commit(&halo->types[DIR_LEFT])))
+      MPIERR(ret);
+   if ((ret = MPI_Type_vector(ghost, ghost, stride, MPI_BYTE, &halo->types[DIR_UP_LEFT])))
+      MPIERR(ret);
+   if ((ret = MPI_Type_commit(&halo->types[DIR_UP_LEFT])))
+      MPIERR(ret);
+   halo->types[DIR_DOWN] = halo->types[DIR_UP];
+   halo->types[DIR_RIGHT] = halo->types[DIR_LEFT];
+   halo->types[DIR_UP_RIGHT] = halo->types[DIR_DOWN_LEFT] = halo->types[DIR_DOWN_RIGHT] = 
+      halo->types[DIR_UP_LEFT];
+   for (d = 0; d < NUM_DIRS; d++)
+   {
+      halo->block_rows[d] = d == DIR_LEFT || d == DIR_RIGHT ? ln : ghost;
+      halo->block_cols[d] = d == DIR_UP || d == DIR_DOWN ? lc : ghost;
+   }
+
+   halo_offsets(ln, lc, ghost, cg, halo->send_off, halo->recv_off);
+   if (method == HALO_SHARED)
+      if ((ret = init_shared(dc, ghost, cg, opposite, cur, next, halo)))
+         return ret;
+   if (method == HALO_RMA)
+      return init_rma(dc, ghost, cg, opposite, cur, next, halo);
+
+   if (method == HALO_PERSISTENT || method == HALO_SHARED)
+   {
+      /* One set of requests for each grid, and for the shared
+       * exchange, only for the neighbors on other nodes. */
+      halo->bufs[0] = *cur;
+      halo->bufs[1] = *next;
+      for (b = 0; b < 2; b++)
+      {
+         halo->nreq = 0;
+         for (d = 0; d < NUM_DIRS; d++)
+         {
+            if (halo->nbr[d] == MPI_PROC_NULL || (method == HALO_SHARED && halo->nbr_bufs[b][d]))
+               continue;
+            if ((ret = MPI_Recv_init(&halo->bufs[b][halo->recv_off[d]], 1, halo->types[d], 
+                                     halo->nbr[d], opposite[d], dc->comm, 
+                                     &halo->req[b][halo->nreq++])))
+               MPIERR(ret);
+            if ((ret = MPI_Send_init(&halo->bufs[b][halo->send_off[d]], 1, halo->types[d], 
+                                     halo->nbr[d], d, dc->comm, &halo->req[b][halo->nreq++])))
+               MPIERR(ret);
+         }
+      }
+   }
+   else
+   {
+      /* The graph has the neighbors that exist, in the order of the
+       * directions, and the same neighbors are sources and
+       * destinations. Each neighbor gets one block, and sends one
+       * back, so there is no need for tags. All the weights are the
+       * same. */
+      for (nn = 0, d = 0; d < NUM_DIRS; d++)
+      {
+         if (halo->nbr[d] == MPI_PROC_NULL)
+            continue;
+         srcs[nn] = halo->nbr[d];
+         weights[nn] = 1;
+         halo->counts[nn] = 1;
+         halo->send_displs[nn] = halo->send_off[d];
+         halo->recv_displs[nn] = halo->recv_off[d];
+         halo->graph_types[nn] = halo->types[d];
+         nn++;
+      }
+      if ((ret = MPI_Dist_graph_create_adjacent(dc->comm, nn, srcs, weights, nn, srcs, 
+                                                weights, MPI_INFO_NULL, 0, &halo->graph)))
+         MPIERR(ret);
+   }
+
+   return 0;
+}
+
+/* Fill all the ghost zones of cur, corners included, in one phase. */
+int
+exchange_halo(struct halo *halo, unsigned char *cur)
+{
+   MPI_Request *req;
+   unsigned char *src;
+   int b, d, i;
+   int ret;
+
+   if (halo->method == HALO_PERSISTENT)
+   {
+      req = halo->req[cur == halo->bufs[0] ? 0 : 1];
+      if ((ret = MPI_Startall(halo->nreq, req)))
+         MPIERR(ret);
+      if ((ret = MPI_Waitall(halo->nreq, req, MPI_STATUSES_IGNORE)))
+         MPIERR(ret);
+   }
+   else if (halo->method == HALO_RMA)
+   {
+      /* Open cur to the neighbors, and put our blocks into theirs, as
+       * they put theirs into ours. Completing our puts, and waiting
+       * for all of theirs, is all the synchronization needed. */
+      b = cur == halo->bufs[0] ? 0 : 1;
+      if ((ret = MPI_Win_post(halo->group, 0, halo->wins[b])))
+         MPIERR(ret);
+      if ((ret = MPI_Win_start(halo->group, 0, halo->wins[b])))
+         MPIERR(ret);
+      for (d = 0; d < NUM_DIRS; d++)
+         if (halo->nbr[d] != MPI_PROC_NULL)
+            if ((ret = MPI_Put(&cur[halo->send_off[d]], 1, halo->types[d], halo->nbr[d], 
+                               halo->target_off[d], 1, halo->target_types[d], 
+                               halo->wins[b])))
+               MPIERR(ret);
+      if ((ret = MPI_Win_complete(halo->wins[b])))
+         MPIERR(ret);
+      if ((ret = MPI_Win_wait(halo->wins[b])))
+         MPIERR(ret);
+   }
+   else if (halo->method == HALO_SHARED)
+   {
+      /* Start the messages to other nodes. Then wait for everyone on
+       * the node to finish cur, copy the blocks of the neighbors on
+       * the node out of their grids, and wait for everyone to finish
+       * copying, since next, which is cleared and written over next,
+       * is the grid the others are copying from. */
+      b = cur == halo->bufs[0] ? 0 : 1;
+      req = halo->req[b];
+      if ((ret = MPI_Startall(halo->nreq, req)))
+         MPIERR(ret);
+      if ((ret = MPI_Win_sync(halo->wins[b])))
+         MPIERR(ret);
+      if ((ret = MPI_Barrier(halo->node)))
+         MPIERR(ret);
+      if ((ret = MPI_Win_sync(halo->wins[b])))
+         MPIERR(ret);
+      for (d = 0; d < NUM_DIRS; d++)
+         if ((src = halo->nbr_bufs[b][d]))
+            for (i = 0; i < halo->block_rows[d]; i++)
+               memcpy(&cur[halo->recv_off[d] + (size_t)i * halo->stride], 
+                      &src[(size_t)i * halo->nbr_stride[d]], halo->block_cols[d]);
+      if ((ret = MPI_Barrier(halo->node)))
+         MPIERR(ret);
+      if ((ret = MPI_Waitall(halo->nreq, req, MPI_STATUSES_IGNORE)))
+         MPIERR(ret);
+   }
+   else
+   {
+      /* The blocks sent and received don't overlap, so cur is both
+       * the send and receive buffer. */
+      if ((ret = MPI_Neighbor_alltoallw(cur, halo->counts, halo->send_displs, 
+                                        halo->graph_types, cur, halo->counts, 
+                                        halo->recv_displs, halo->graph_types, halo->graph)))
+         MPIERR(ret);
+   }
+
+   return 0;
+}
+
+/* Free the requests, types, communicators and windows of a halo
+ * exchange. The shared and RMA grids go with their windows. */
+int
+finish_halo(struct halo *halo)
+{
+   int b, i;
+
+   if (halo->method == HALO_TWO_PHASE)
+      return 0;
+   if (halo->method == HALO_PACKED)
+   {
+      free(halo->col_bufs);
+      return 0;
+   }
+
+   for (b = 0; b < 2; b++)
+      for (i = 0; i < halo->nreq; i++)
+         MPI_Request_free(&halo->req[b][i]);
+   MPI_Type_free(&halo->types[DIR_UP]);
+   MPI_Type_free(&halo->types[DIR_LEFT]);
+   MPI_Type_free(&halo->types[DIR_UP_LEFT]);
+   if (halo->graph != MPI_COMM_NULL)
+      MPI_Comm_free(&halo->graph);
+   if (halo->method == HALO_RMA)
+   {
+      for (b = 0; b < 2; b++)
+         MPI_Win_free(&halo->wins[b]);
+      for (i = 0; i < NUM_DIRS; i++)
+         if (halo->nbr[i] != MPI_PROC_NULL)
+            MPI_Type_free(&halo->target_types[i]);
+      MPI_Group_free(&halo->group);
+   }
+   if (halo->node != MPI_COMM_NULL)
+   {
+      for (b = 0; b < 2; b++)
+      {
+         MPI_Win_unlock_all(halo->wins[b]);
+         MPI_Win_free(&halo->wins[b]);
+      }
+      MPI_Comm_free(&halo->node);
+   }
+
+   return 0;
+}
+
+/* Send the edge information to adjacent processes so that everyone
+ * knows what it needs to from its neighbors. */
+int
+update_processes(struct decomp *dc, struct halo *halo, int my_rank, int p, int checkerboard, 
+                 int ghost, int verbose, MPI_Datatype row_type, MPI_Datatype col_type, 
+                 int event_num[][NUM_EVENTS], unsigned char *cur)
+{
+   MPI_Request req[4];
+   int ret;
+
+   phase_start(UPDATE);
+#ifdef LOGGING
+   if ((ret = MPE_Log_event(event_num[START][UPDATE], 0, "start update")))
+      MPIERR(ret);
+#endif
+
+   if (verbose && ! my_rank)
+      printf("starting update\n");
+   
+   /* Fill the ghost rows. */
+   if (p > 1)
+   {
+      /* On verbose runs, barrier here to make text output look nicer. */
+      if (checkerboard && verbose)
+         MPI_Barrier(MPI_COMM_WORLD);
+
+      if (halo->method != HALO_TWO_PHASE && halo->method != HALO_PACKED)
+      {
+         /* The corners come straight from the diagonal neighbors. */
+         if ((ret = exchange_halo(halo, cur)))
+            return ret;
+      }
+      else
+      {
+         /* All row sends must complete before col sends, because
+          * of the corners. */
+         if ((ret = post_row_exchange(dc, checkerboard, ghost, row_type, cur, req)))
+            return ret;
+         if ((ret = MPI_Waitall(4, req, MPI_STATUSES_IGNORE)))
+            MPIERR(ret);
+
+         /* All col sends must complete before we calculate. */
+         if (checkerboard)
+         {
+            if ((ret = post_col_exchange(dc, ghost, col_type, halo->col_bufs, cur, req)))
+               return ret;
+            if ((ret = wait_col_exchange(dc, ghost, halo->col_bufs, cur, req)))
+               return ret;
+         }
+      }
+   }
+
+   phase_end(UPDATE);
+#ifdef LOGGING
+   if ((ret = MPE_Log_event(event_num[END][UPDATE], 0, "end update")))
+      MPIERR(ret);
+#endif
+
+   return 0;
+}
+
+/* The scalar kernel leaves the whole row to calculate_next_step. */
+int
+life_row_scalar(const unsigned char *up, const unsigned char *mid, 
+                const unsigned char *down, unsigned char *out, int j, int end, 
+                int *live)
+{
+   return j;
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse2")))
+int
+life_row_sse2(const unsigned char *up, const unsigned char *mid, 
+              const unsigned char *down, unsigned char *out, int j, int end, int *live)
+{
+   const __m128i zero = _mm_setzero_si128(), one = _mm_set1_epi8(1);
+   const __m128i two = _mm_set1_epi8(2), three = _mm_set1_epi8(3);
+   __m128i neighbors, self, alive;
+   int first, done;
+
+#define LOAD_SSE2(p) _mm_min_epu8(_mm_loadu_si128((const __m128i *)(p)), one)
+   for (first = done = j; j < end; j += 16)
+   {
+      /* The last vector may overlap the one before, when there is one. */
+      if (j + 16 > end)
+      {
+         if (end - first < 16)
+            break;
+         j = end - 16;
+      }
+
+      neighbors = _mm_add_epi8(_mm_add_epi8(LOAD_SSE2(&up[j - 1]), LOAD_SSE2(&up[j])), 
+                               _mm_add_epi8(LOAD_SSE2(&up[j + 1]), LOAD_SSE2(&mid[j - 1])));
+      neighbors = _mm_add_epi8(neighbors, 
+                               _mm_add_epi8(_mm_add_epi8(LOAD_SSE2(&mid[j + 1]), LOAD_SSE2(&down[j - 1])), 
+                                            _mm_add_epi8(LOAD_SSE2(&down[j]), LOAD_SSE2(&down[j + 1]))));
+      self = _mm_loadu_si128((const __m128i *)&mid[j]);
+
+      /* Born or stayin' alive. */
+      alive = _mm_or_si128(_mm_cmpeq_epi8(neighbors, three), 
+                           _mm_andnot_si128(_mm_cmpeq_epi8(self, zero), 
+                                            _mm_cmpeq_epi8(neighbors, two)));
+      _mm_storeu_si128((__m128i *)&out[j], alive);
+      if (live)
+         *live += __builtin_popcount((unsigned)_mm_movemask_epi8(alive) >> (done - j));
+      done = j + 16;
+   }
+#undef LOAD_SSE2
+   return j;
+}
+
+__attribute__((target("avx2")))
+int
+life_row_avx2(const unsigned char *up, const unsigned char *mid, 
+              const unsigned char *down, unsigned char *out, int j, int end, int *live)
+{
+   const __m256i zero = _mm256_setzero_si256(), one = _mm256_set1_epi8(1);
+   const __m256i two = _mm256_set1_epi8(2), three = _mm256_set1_epi8(3);
+   __m256i neighbors, self, alive;
+   int first, done;
+
+#define LOAD_AVX2(p) _mm256_min_epu8(_mm256_loadu_si256((const __m256i *)(p)), one)
+   for (first = done = j; j < end; j += 32)
+   {
+      /* The last vector may overlap the one before, when there is one. */
+      if (j + 32 > end)
+      {
+         if (end - first < 32)
+            break;
+         j = end - 32;
+      }
+
+      neighbors = _mm256_add_epi8(_mm256_add_epi8(LOAD_AVX2(&up[j - 1]), LOAD_AVX2(&up[j])), 
+                                  _mm256_add_epi8(LOAD_AVX2(&up[j + 1]), LOAD_AVX2(&mid[j - 1])));
+      neighbors = _mm256_add_epi8(neighbors, 
+                                  _mm256_add_epi8(_mm256_add_epi8(LOAD_AVX2(&mid[j + 1]), LOAD_AVX2(&down[j - 1])), 
+                                                  _mm256_add_epi8(LOAD_AVX2(&down[j]), LOAD_AVX2(&down[j + 1]))));
+      self = _mm256_loadu_si256((const __m256i *)&mid[j]);
+
+      alive = _mm256_or_si256(_mm256_cmpeq_epi8(neighbors, three), 
+                              _mm256_andnot_si256(_mm256_cmpeq_epi8(self, zero), 
+                                                  _mm256_cmpeq_epi8(neighbors, two)));
+      _mm256_storeu_si256((__m256i *)&out[j], alive);
+      if (live)
+         *live += __builtin_popcount((unsigned)_mm256_movemask_epi8(alive) >> (done - j));
+      done = j + 32;
+   }
+#undef LOAD_AVX2
+   return j;
+}
+
+__attribute__((target("avx512f,avx512bw")))
+int
+life_row_avx512(const unsigned char *up, const unsigned char *mid, 
+                const unsigned char *down, unsigned char *out, int j, int end, int *live)
+{
+   const __m512i one = _mm512_set1_epi8(1);
+   const __m512i two = _mm512_set1_epi8(2), three = _mm512_set1_epi8(3);
+   __m512i neighbors, self;
+   int first, done;
+   __mmask64 born, stay, alive;
+
+#define LOAD_AVX512(p) _mm512_min_epu8(_mm512_loadu_si512((const void *)(p)), one)
+   for (first = done = j; j < end; j += 64)
+   {
+      /* The last vector may overlap the one before, when there is one. */
+      if (j + 64 > end)
+      {
+         if (end - first < 64)
+            break;
+         j = end - 64;
+      }
+
+      neighbors = _mm512_add_epi8(_mm512_add_epi8(LOAD_AVX512(&up[j - 1]), LOAD_AVX512(&up[j])), 
+                                  _mm512_add_epi8(LOAD_AVX512(&up[j + 1]), LOAD_AVX512(&mid[j - 1])));
+      neighbors = _mm512_add_epi8(neighbors, 
+                                  _mm512_add_epi8(_mm512_add_epi8(LOAD_AVX512(&mid[j + 1]), LOAD_AVX512(&down[j - 1])), 
+                                                  _mm512_add_epi8(LOAD_AVX512(&down[j]), LOAD_AVX512(&down[j + 1]))));
+      self = _mm512_loadu_si512((const void *)&mid[j]);
+
+      /* The compares give bit masks, which are expanded back to bytes
+       * of 255 or 0. */
+      alive = _mm512_test_epi8_mask(self, self);
+      born = _mm512_cmpeq_epi8_mask(neighbors, three);
+      stay = _mm512_cmpeq_epi8_mask(neighbors, two) & alive;
+      _mm512_storeu_si512((void *)&out[j], _mm512_movm_epi8(born | stay));
+      if (live)
+         *live += __builtin_popcountll((born | stay) >> (done - j));
+      done = j + 64;
+   }
+#undef LOAD_AVX512
+   return j;
+}
+
+/* The same for rules other than B3/S23, from the rule's tables. SSE2
+ * has no byte shuffle, so it compares the neighbor count with each
+ * count in the rule; the wider kernels look up the count in the tables
+ * with a shuffle, which takes indices up to 15. */
+__attribute__((target("sse2")))
+int
+rule_row_sse2(const unsigned char *up, const unsigned char *mid, 
+              const unsigned char *down, unsigned char *out, int j, int end, int *live)
+{
+   const __m128i zero = _mm_setzero_si128(), one = _mm_set1_epi8(1);
+   __m128i neighbors, dead, born, stay, alive, n;
+   int first, done, k;
+
+#define LOAD_SSE2(p) _mm_min_epu8(_mm_loadu_si128((const __m128i *)(p)), one)
+   for (first = done = j; j < end; j += 16)
+   {
+      if (j + 16 > end)
+      {
+         if (end - first < 16)
+            break;
+         j = end - 16;
+      }
+
+      neighbors = _mm_add_epi8(_mm_add_epi8(LOAD_SSE2(&up[j - 1]), LOAD_SSE2(&up[j])), 
+                               _mm_add_epi8(LOAD_SSE2(&up[j + 1]), LOAD_SSE2(&mid[j - 1])));
+      neighbors = _mm_add_epi8(neighbors, 
+                               _mm_add_epi8(_mm_add_epi8(LOAD_SSE2(&mid[j + 1]), LOAD_SSE2(&down[j - 1])), 
+                                            _mm_add_epi8(LOAD_SSE2(&down[j]), LOAD_SSE2(&down[j + 1]))));
+      dead = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)&mid[j]), zero);
+
+      born = stay = zero;
+      for (k = 0; k <= MAX_NEIGHBORS; k++)
+         if ((rule.birth | rule.survive) & (1 << k))
+         {
+            n = _mm_cmpeq_epi8(neighbors, _mm_set1_epi8((char)k));
+            if (rule.birth & (1 << k))
+               born = _mm_or_si128(born, n);
+            if (rule.survive & (1 << k))
+               stay = _mm_or_si128(stay, n);
+         }
+      alive = _mm_or_si128(_mm_and_si128(dead, born), _mm_andnot_si128(dead, stay));
+      _mm_storeu_si128((__m128i *)&out[j], alive);
+      if (live)
+         *live += __builtin_popcount((unsigned)_mm_movemask_epi8(alive) >> (done - j));
+      done = j + 16;
+   }
+#undef LOAD_SSE2
+   return j;
+}
+
+__attribute__((target("avx2")))
+int
+rule_row_avx2(const unsigned char *up, const unsigned char *mid, 
+              const unsigned char *down, unsigned char *out, int j, int end, int *live)
+{
+   const __m256i zero = _mm256_setzero_si256(), one = _mm256_set1_epi8(1);
+   const __m256i born_table = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)rule.table[0]));
+   const __m256i stay_table = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)rule.table[1]));
+   __m256i neighbors, dead, alive;
+   int first, done;
+
+#define LOAD_AVX2(p) _mm256_min_epu8(_mm256_loadu_si256((const __m256i *)(p)), one)
+   for (first = done = j; j < end; j += 32)
+   {
+      if (j + 32 > end)
+      {
+         if (end - first < 32)
+            break;
+         j = end - 32;
+      }
+
+      neighbors = _mm256_add_epi8(_mm256_add_epi8(LOAD_AVX2(&up[j - 1]), LOAD_AVX2(&up[j])), 
+                                  _mm256_add_epi8(LOAD_AVX2(&up[j + 1]), LOAD_AVX2(&mid[j - 1])));
+      neighbors = _mm256_add_epi8(neighbors, 
+                                  _mm256_add_epi8(_mm256_add_epi8(LOAD_AVX2(&mid[j + 1]), LOAD_AVX2(&down[j - 1])), 
+                                                  _mm256_add_epi8(LOAD_AVX2(&down[j]), LOAD_AVX2(&down[j + 1]))));
+      dead = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)&mid[j]), zero);
+
+      /* Dead cells look up their fate in the birth table, live ones
+       * in the survival table. */
+      alive = _mm256_blendv_epi8(_mm256_shuffle_epi8(stay_table, neighbors), 
+                                 _mm256_shuffle_epi8(born_table, neighbors), dead);
+      _mm256_storeu_si256((__m256i *)&out[j], alive);
+      if (live)
+         *live += __builtin_popcount((unsigned)_mm256_movemask_epi8(alive) >> (done - j));
+      done = j + 32;
+   }
+#undef LOAD_AVX2
+   return j;
+}
+
+__attribute__((target("avx512f,avx512bw")))
+int
+rule_row_avx512(const unsigned char *up, const unsigned char *mid, 
+                const unsigned char *down, unsigned char *out, int j, int end, int *live)
+{
+   const __m512i one = _mm512_set1_epi8(1);
+   const __m512i born_table = _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *)rule.table[0]));
+   const __m512i stay_table = _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *)rule.table[1]));
+   __m512i neighbors, self, next;
+   int first, done;
+   __mmask64 alive;
+
+#define LOAD_AVX512(p) _mm512_min_epu8(_mm512_loadu_si512((const void *)(p)), one)
+   for (first = done = j; j < end; j += 64)
+   {
+      if (j + 64 > end)
+      {
+         if (end - first < 64)
+            break;
+         j = end - 64;
+      }
+
+      neighbors = _mm512_add_epi8(_mm512_add_epi8(LOAD_AVX512(&up[j - 1]), LOAD_AVX512(&up[j])), 
+                                  _mm512_add_epi8(LOAD_AVX512(&up[j + 1]), LOAD_AVX512(&mid[j - 1])));
+      neighbors = _mm512_add_epi8(neighbors, 
+                                  _mm512_add_epi8(_mm512_add_epi8(LOAD_AVX512(&mid[j + 1]), LOAD_AVX512(&down[j - 1])), 
+                                                  _mm512_add_epi8(LOAD_AVX512(&down[j]), LOAD_AVX512(&down[j + 1]))));
+      self = _mm512_loadu_si512((const void *)&mid[j]);
+
+      alive = _mm512_test_epi8_mask(self, self);
+      next = _mm512_mask_blend_epi8(alive, _mm512_shuffle_epi8(born_table, neighbors), 
+                                    _mm512_shuffle_epi8(stay_table, neighbors));
+      _mm512_storeu_si512((void *)&out[j], next);
+      if (live)
+         *live += __builtin_popcountll(_mm512_movepi8_mask(next) >> (done - j));
+      done = j + 64;
+   }
+#undef LOAD_AVX512
+   return j;
+}
+#endif /* HAVE_X86_SIMD */
+
+/* Decide which row kernel to use. If the user asked for a particular
+ * one, make sure this CPU can run it, otherwise pick the widest one
+ * that it can. */
+int
+select_row_kernel(int my_rank, int verbose, int *kernel, row_kernel_t *row_kernel)
+{
+   static const char *kernel_name[NUM_KERNELS] = {"scalar", "sse2", "avx2", "avx512"};
+   int supported[NUM_KERNELS] = {1, 0, 0, 0};
+   int k;
+
+#ifdef HAVE_X86_SIMD
+   __builtin_cpu_init();
+   supported[KERNEL_SSE2] = __builtin_cpu_supports("sse2");
+   supported[KERNEL_AVX2] = __builtin_cpu_supports("avx2");
+   supported[KERNEL_AVX512] = __builtin_cpu_supports("avx512f") && 
+      __builtin_cpu_supports("avx512bw");
+#endif
+
+   if (*kernel == KERNEL_AUTO)
+      for (k = 0; k < NUM_KERNELS; k++)
+         if (supported[k])
+            *kernel = k;
+   if (*kernel < 0 || *kernel >= NUM_KERNELS || !supported[*kernel])
+      return ERR_ARG;
+
+   /* B3/S23 has kernels of its own, other rules use the tables. */
+   switch (*kernel)
+   {
+#ifdef HAVE_X86_SIMD
+      case KERNEL_SSE2:
+         *row_kernel = conway_rule() ? life_row_sse2 : rule_row_sse2;
+         break;
+      case KERNEL_AVX2:
+         *row_kernel = conway_rule() ? life_row_avx2 : rule_row_avx2;
+         break;
+      case KERNEL_AVX512:
+         *row_kernel = conway_rule() ? life_row_avx512 : rule_row_avx512;
+         break;
+#endif
+      default:
+         *row_kernel = life_row_scalar;
+   }
+
+   if (verbose && !my_rank)
+      printf("using %s kernel%s\n", kernel_name[*kernel], conway_rule() ? "" : " with rule tables");
+
+   return 0;
+}
+
+/* Compute rows [first, last), columns [first_col, last_col) of the
+ * next byte grid, which has ln rows and lc columns of real data. For
+ * checkerboard the columns count the ghost columns; row decomposition
+ * has none, and its rows are the whole board, 0 to lc. If live is not
+ * NULL, the live cells computed which are real cells, not ghosts, are
+ * added to it, while each row is still in cache. */
+void
+calculate_rows(int checkerboard, int ln, int lc, int ghost, row_kernel_t row_kernel, 
+               unsigned char *cur, unsigned char *next, int first, int last, 
+               int first_col, int last_col, int64_t *live)
+{
+   size_t stride = checkerboard ? lc + 2 * ghost : lc;
+   int start = first_col > 1 ? first_col : 1;
+   unsigned char *up, *mid, *down, *out;
+   int neighbors, row_count;
+   int i, j, jv;
+   int *row_live;
+
+   /* Rows are found with size_t offsets, since a local grid may have
+    * more than 2^31 cells; within a row, int is enough. Each row is
+    * counted on its own, and added to live. */
+   for (i = first; i < last; i++)
+   {
+      up = &cur[(i - 1) * stride];
+      mid = &cur[i * stride];
+      down = &cur[(i + 1) * stride];
+      out = &next[i * stride];
+
+      /* Deep ghost rows are computed, but not counted. */
+      row_count = 0;
+      row_live = live && i >= ghost && i < ln + ghost ? &row_count : NULL;
+
+      if (checkerboard)
+      {
+         /* Skip first and last row and col, the ghost data. The row
+          * kernel does what it can, we do the rest. */
+         jv = row_kernel(up, mid, down, out, first_col, last_col, row_live);
+         for (j = jv; j < last_col; j++)
+         {
+            /* Count neighbors. */
+            neighbors = 0;
+            if (up[j-1]) neighbors++;
+            if (up[j]) neighbors++;
+            if (up[j+1]) neighbors++;
+
+            if (mid[j-1]) neighbors++;
+            if (mid[j+1]) neighbors++;
+
+            if (down[j-1]) neighbors++;
+            if (down[j]) neighbors++;
+            if (down[j+1]) neighbors++;
+
+            /* Check for change. */
+            out[j] = rule.table[mid[j] ? 1 : 0][neighbors];
+            if (row_live && out[j])
+               (*row_live)++;
+
+/*             if (verbose)
+               printf("%d: %d, %d, cur=%d, neighbors=%d next=%d\n", my_rank, i, j, mid[j], 
+               neighbors, out[j]);*/
+         } /* next j */
+
+         /* Take back the deep ghost columns. */
+         if (row_live)
+         {
+            for (j = first_col; j < last_col && j < ghost; j++)
+               if (out[j])
+                  (*row_live)--;
+            for (j = first_col > lc + ghost ? first_col : lc + ghost; j < last_col; j++)
+               if (out[j])
+                  (*row_live)--;
+         }
+      }
+      else
+      {
+         /* The row kernel can only do the cells which have a
+          * neighbor on both sides, and then we skip over them. */
+         jv = row_kernel(up, mid, down, out, start, last_col < lc - 1 ? last_col : lc - 1, 
+                         row_live);
+         for (j = first_col; j < last_col; j++)
+         {
+            if (j == start)
+               if ((j = jv) >= last_col)
+                  break;
+
+            /* Count neighbors. */
+            neighbors = 0;
+            if (j && up[j-1]) neighbors++;
+            if (up[j]) neighbors++;
+            if (j < lc - 1 && up[j+1]) neighbors++;
+
+            if (j && mid[j-1]) neighbors++;
+            if (j < lc - 1 && mid[j+1]) neighbors++;
+
+            if (j && down[j-1]) neighbors++;
+            if (down[j]) neighbors++;
+            if (j < lc - 1 && down[j+1]) neighbors++;
+
+            /* Check for change. */
+            out[j] = rule.table[mid[j] ? 1 : 0][neighbors];
+            if (row_live && out[j])
+               (*row_live)++;
+
+/*          if (verbose)
+            printf("%d: %d, %d, cur=%d, neighbors=%d next=%d\n", my_rank, i, j, mid[j], 
+            neighbors, out[j]);*/
+         } /* next j */
+      }
+
+      if (row_live)
+         *live += row_count;
+   } /* next i */
+}
+
+/* Compute rows [first, last) as calculate_rows does, but in strips of
+ * block_cols columns, each from top to bottom, so that the rows above
+ * and below are still in cache when they are read again. */
+void
+calculate_strips(int checkerboard, int ln, int lc, int ghost, row_kernel_t row_kernel, 
+                 unsigned char *cur, unsigned char *next, int first, int last, 
+                 int first_col, int last_col, int64_t *live)
+{
+   int j;
+
+   if (!block_cols || last_col - first_col <= block_cols)
+      calculate_rows(checkerboard, ln, lc, ghost, row_kernel, cur, next, first, last, 
+                     first_col, last_col, live);
+   else
+      for (j = first_col; j < last_col; j += block_cols)
+         calculate_rows(checkerboard, ln, lc, ghost, row_kernel, cur, next, first, last, 
+                        j, j + block_cols < last_col ? j + block_cols : last_col, live);
+}
+
+/* Find the width of the strips for a cache of size bytes, which
+ * should hold the four rows of a strip twice over, leaving room for
+ * the next rows to come in. The L1 cache is too small for this to pay:
+ * rows that fit in L2 are streamed from it as fast as the kernels
+ * go, so it is L2 that the strips are fitted to. Without its size,
+ * assume 2M. */
+int
+cache_block_cols(long size)
+{
+   if (size <= 0)
+      size = 2 * 1024 * 1024;
+   return (int)(size / 8) & ~63;
+}
+
+/* Count the live cells in rows [first, last) of a byte grid, skipping
+ * the ghost columns for checkerboard. */
+int64_t
+count_rows(int checkerboard, int ln, int lc, int ghost, unsigned char *buf, 
+           int first, int last)
+{
+   int64_t my_total = 0;
+   size_t i, k;
+   int j;
+
+   if (checkerboard)
+   {
+      for (i = first; i < last; i++)
+         for (j = ghost; j < lc + ghost; j++)
+            if (buf[i * (lc + 2 * ghost) + j]) 
+               my_total++;
+   }
+   else
+   {
+      for (k = (size_t)first * lc; k < (size_t)last * lc; k++)
+         if (buf[k]) 
+            my_total++;
+   }
+   return my_total;
+}
+
+/* Zero rows [first, last) of a byte grid. */
+void
+clear_rows(int checkerboard, int ln, int lc, int ghost, unsigned char *buf, 
+           int first, int last)
+{
+   size_t stride = checkerboard ? lc + 2 * ghost : lc;
+
+   memset(&buf[first * stride], 0, (last - first) * stride);
+}
+
+/* Do one tile of the pool's current job. Tiles are bands of
+ * tile_rows rows of the job's rows. */
+void
+do_tile(struct pool *pool, int id, int tile)
+{
+   int first = pool->first + tile * pool->tile_rows;
+   int last = first + pool->tile_rows;
+
+   if (last > pool->last)
+      last = pool->last;
+
+   switch (pool->job)
+   {
+      case JOB_CALCULATE:
+         calculate_strips(pool->checkerboard, pool->ln, pool->lc, pool->ghost, 
+                          pool->row_kernel, pool->cur, pool->next, first, last, 
+                          pool->first_col, pool->last_col, 
+                          pool->counting ? &pool->counts[id] : NULL);
+         break;
+      case JOB_COUNT:
+         pool->counts[id] += count_rows(pool->checkerboard, pool->ln, pool->lc, 
+                                        pool->ghost, pool->cur, first, last);
+         break;
+      case JOB_CLEAR:
+         clear_rows(pool->checkerboard, pool->ln, pool->lc, pool->ghost, pool->next, 
+                    first, last);
+         break;
+   }
+}
+
+/* Take the next tile from the front of a queue, or, when stealing,
+ * from the back. Returns -1 if the queue is empty. */
+int
+take_tile(struct tile_queue *queue, int steal)
+{
+   int tile = -1;
+
+   pthread_mutex_lock(&queue->lock);
+   if (queue->head < queue->tail)
+      tile = steal ? --queue->tail : queue->head++;
+   pthread_mutex_unlock(&queue->lock);
+   return tile;
+}
+
+/* Work through my own tiles, then steal from the other threads until
+ * there is nothing left. */
+void
+run_tiles(struct pool *pool, int id)
+{
+   int tile, victim;
+
+   while ((tile = take_tile(&pool->queue[id], 0)) >= 0)
+      do_tile(pool, id, tile);
+   for (victim = (id + 1) % pool->nthreads; victim != id; victim = (victim + 1) % pool->nthreads)
+      while ((tile = take_tile(&pool->queue[victim], 1)) >= 0)
+         do_tile(pool, id, tile);
+}
+
+/* This is what the worker threads do: wait for a job, do their
+ * share of it, and report back, until they are told to quit. */
+void *
+pool_worker(void *arg)
+{
+   struct pool_arg *pa = arg;
+
+   for (;;)
+   {
+      pthread_barrier_wait(&pa->pool->start);
+      if (pa->pool->job == JOB_QUIT)
+         break;
+      run_tiles(pa->pool, pa->id);
+      pthread_barrier_wait(&pa->pool->done);
+   }
+   return NULL;
+}
+
+/* Run a job on rows [first, last) of the grid (and, for calculating
+ * checkerboard, columns [first_col, last_col)). The main thread deals
+ * the tiles out evenly, wakes the workers, does its own share as
+ * thread 0, and returns when every tile is done. Only the main thread
+ * ever calls MPI. */
+int
+run_pool(struct pool *pool, int job, int first, int last, int first_col, int last_col)
+{
+   int t;
+
+   if (last <= first)
+      return 0;
+   pool->job = job;
+   pool->first = first;
+   pool->last = last;
+   pool->first_col = first_col;
+   pool->last_col = last_col;
+   pool->ntiles = (last - first + pool->tile_rows - 1) / pool->tile_rows;
+   for (t = 0; t < pool->nthreads; t++)
+   {
+      pool->queue[t].head = t * pool->ntiles / pool->nthreads;
+      pool->queue[t].tail = (t + 1) * pool->ntiles / pool->nthreads;
+      pool->counts[t] = 0;
+   }
+
+   pthread_barrier_wait(&pool->start);
+   run_tiles(pool, 0);
+   pthread_barrier_wait(&pool->done);
+
+   return 0;
+}
+
+/* Start nthreads - 1 worker threads to help the main thread with the
+ * rows of the local grid, split into tiles of tile_rows rows. */
+int
+init_pool(int nthreads, int checkerboard, int ln, int lc, int ghost, int tile_rows, 
+          row_kernel_t row_kernel, struct pool *pool)
+{
+   int t;
+
+   memset(pool, 0, sizeof(struct pool));
+   pool->nthreads = nthreads;
+   pool->checkerboard = checkerboard;
+   pool->ln = ln;
+   pool->lc = lc;
+   pool->ghost = ghost;
+   pool->tile_rows = tile_rows;
+   pool->ntiles = (ln + tile_rows - 1) / tile_rows;
+   pool->row_kernel = row_kernel;
+
+   if (!(pool->threads = calloc(nthreads, sizeof(pthread_t))) ||
+       !(pool->args = calloc(nthreads, sizeof(struct pool_arg))) ||
+       !(pool->queue = calloc(nthreads, sizeof(struct tile_queue))) ||
+       !(pool->counts = calloc(nthreads, sizeof(int64_t))))
+      return ERR_DUMB;
+   if (pthread_barrier_init(&pool->start, NULL, nthreads) ||
+       pthread_barrier_init(&pool->done, NULL, nthreads))
+      return ERR_INIT;
+   for (t = 0; t < nthreads; t++)
+      if (pthread_mutex_init(&pool->queue[t].lock, NULL))
+         return ERR_INIT;
+   for (t = 1; t < nthreads; t++)
+   {
+      pool->args[t].pool = pool;
+      pool->args[t].id = t;
+      if (pthread_create(&pool->threads[t], NULL, pool_worker, &pool->args[t]))
+         return ERR_INIT;
+   }
+
+   return 0;
+}
+
+/* Tell the workers to quit, and clean up. */
+int
+finish_pool(struct pool *pool)
+{
+   int t;
+
+   pool->job = JOB_QUIT;
+   pthread_barrier_wait(&pool->start);
+   for (t = 1; t < pool->nthreads; t++)
+      pthread_join(pool->threads[t], NULL);
+   for (t = 0; t < pool->nthreads; t++)
+      pthread_mutex_destroy(&pool->queue[t].lock);
+   pthread_barrier_destroy(&pool->start);
+   pthread_barrier_destroy(&pool->done);
+   free(pool->threads);
+   free(pool->args);
+   free(pool->queue);
+   free(pool->counts);
+
+   return 0;
+}
+
+/* Compute rows [first, last) and, for checkerboard, columns
+ * [first_col, last_col) of the next grid, with the pool of threads if
+ * there is one, adding the live cells to live if it is not NULL. */
+void
+calculate_region(int checkerboard, int ln, int lc, int ghost, row_kernel_t row_kernel, 
+                 struct pool *pool, unsigned char *cur, unsigned char *next, 
+                 int first, int last, int first_col, int last_col, int64_t *live)
+{
+   int t;
+
+   if (pool)
+   {
+      pool->cur = cur;
+      pool->next = next;
+      pool->counting = live != NULL;
+      run_pool(pool, JOB_CALCULATE, first, last, first_col, last_col);
+      if (live && last > first)
+         for (t = 0; t < pool->nthreads; t++)
+            *live += pool->counts[t];
+   }
+   else
+      calculate_strips(checkerboard, ln, lc, ghost, row_kernel, cur, next, first, last, 
+                       first_col, last_col, live);
+}
+
+/* Work out which part of the local grid can be computed t steps
+ * after the last exchange of ghost zones ghost cells deep. The region
+ * shrinks by one cell on each side every step, except at the edges of
+ * the board, where the cells past the edge are never computed, and
+ * stay dead. The region is returned as first row, last row, first
+ * column, last column (last ones not included). With ghost = 1 this
+ * is just the real cells. */
+void
+valid_region(struct decomp *dc, int checkerboard, int ghost, int t, int *region)
+{
+   int ln = dc->ln, lc = dc->lc;
+
+   region[0] = dc->up == MPI_PROC_NULL ? ghost : 1 + t;
+   region[1] = dc->down == MPI_PROC_NULL ? ln + ghost : ln + 2 * ghost - 1 - t;
+   if (checkerboard)
+   {
+      region[2] = dc->left == MPI_PROC_NULL ? ghost : 1 + t;
+      region[3] = dc->right == MPI_PROC_NULL ? lc + ghost : lc + 2 * ghost - 1 - t;
+   }
+   else
+   {
+      region[2] = 0;
+      region[3] = lc;
+   }
+}
+
+/* Advance the game of life by one step by looking at the cur array
+ * and filling the next array with the values for the next
+ * generation, over the region returned by valid_region. If live is
+ * not NULL, it gets the number of live cells in the new generation. */
+int 
+calculate_next_step(int checkerboard, int ln, int lc, int ghost, int *region, 
+                    int event_num[][NUM_EVENTS], row_kernel_t row_kernel, 
+                    struct pool *pool, unsigned char *cur, unsigned char *next, int64_t *live)
+{
+#ifdef LOGGING
+   int ret;
+#endif
+
+   phase_start(CALCULATE);
+#ifdef LOGGING
+   if ((ret = MPE_Log_event(event_num[START][CALCULATE], 0, "start calculate")))
+      MPIERR(ret);
+#endif
+
+   if (live)
+      *live = 0;
+   calculate_region(checkerboard, ln, lc, ghost, row_kernel, pool, cur, next, 
+                    region[0], region[1], region[2], region[3], live);
+
+   phase_end(CALCULATE);
+#ifdef LOGGING
+   if ((ret = MPE_Log_event(event_num[END][CALCULATE], 0, "end calculate")))
+      MPIERR(ret);
+#endif
+
+   return 0;
+}
+
+/* Cut the local grid into tiles of tile_size cells on a side, all of
+ * which count as changed, so the first step computes them all. */
+int
+init_tiles(struct decomp *dc, int tile_size, struct tiles *tiles)
+{
+   if (tile_size < 1)
+      return ERR_ARG;
+   tiles->tile_size = tile_size;
+   tiles->nrows = (dc->ln + tile_size - 1) / tile_size;
+   tiles->ncols = (dc->lc + tile_size - 1) / tile_size;
+   tiles->nactive = 0;
+   if (!(tiles->changed = calloc(tiles->nrows * tiles->ncols, 1)))
+      return ERR_DUMB;
+   if (!(tiles->was_changed = malloc(tiles->nrows * tiles->ncols)))
+      return ERR_DUMB;
+   memset(tiles->was_changed, 1, tiles->nrows * tiles->ncols);
+
+   return 0;
+}
+
+/* Compute the next generation of the tiles which may have changed,
+ * and note which of them did. A tile changed if any byte of it
+ * differs between cur and next, so the first generation, when cur
+ * still has the values read from the file, marks the live tiles as
+ * changed even if nothing happened. This is what keeps next right for
+ * still tiles. */
+int
+calculate_tiles(struct decomp *dc, int checkerboard, int ghost, struct tiles *tiles, 
+                int event_num[][NUM_EVENTS], row_kernel_t row_kernel, 
+                unsigned char *cur, unsigned char *next)
+{
+   int ln = dc->ln, lc = dc->lc;
+   int stride = checkerboard ? lc + 2 * ghost : lc;
+   int cg = checkerboard ? ghost : 0;
+   int ts = tiles->tile_size;
+   int ti, tj, tk, di, dj, i, active;
+   int first, last, first_col, last_col;
+   unsigned char *act = tiles->changed, *temp;
+#ifdef LOGGING
+   int ret;
+#endif
+
+   phase_start(CALCULATE);
+#ifdef LOGGING
+   if ((ret = MPE_Log_event(event_num[START][CALCULATE], 0, "start calculate")))
+      MPIERR(ret);
+#endif
+
+   /* Is each tile, or are any of its neighbors, changing? The answers
+    * go in changed, and each is replaced by whether the tile did change
+    * once it is computed. */
+   for (ti = 0; ti < tiles->nrows; ti++)
+      for (tj = 0; tj < tiles->ncols; tj++)
+      {
+         active = (!ti && dc->up != MPI_PROC_NULL) || 
+            (ti == tiles->nrows - 1 && dc->down != MPI_PROC_NULL) || 
+            (!tj && dc->left != MPI_PROC_NULL) || 
+            (tj == tiles->ncols - 1 && dc->right != MPI_PROC_NULL);
+         for (di = -1; di <= 1 && !active; di++)
+            for (dj = -1; dj <= 1 && !active; dj++)
+               if (ti + di >= 0 && ti + di < tiles->nrows && 
+                   tj + dj >= 0 && tj + dj < tiles->ncols)
+                  active = tiles->was_changed[(ti + di) * tiles->ncols + tj + dj];
+         act[ti * tiles->ncols + tj] = (unsigned char)active;
+      }
+
+   tiles->nactive = 0;
+   for (ti = 0; ti < tiles->nrows; ti++)
+   {
+      first = ghost + ti * ts;
+      last = first + ts < ln + ghost ? first + ts : ln + ghost;
+      for (tj = 0; tj < tiles->ncols; tj = tk)
+      {
+         /* Compute each run of active tiles in one go, so the row
+          * kernel gets long rows. */
+         for (tk = tj; tk < tiles->ncols && act[ti * tiles->ncols + tk]; tk++)
+            ;
+         if (tk == tj)
+         {
+            tk++;
+            continue;
+         }
+         first_col = cg + tj * ts;
+         last_col = cg + tk * ts < lc + cg ? cg + tk * ts : lc + cg;
+         calculate_rows(checkerboard, ln, lc, ghost, row_kernel, cur, next, first, last, 
+                        first_col, last_col, NULL);
+         tiles->nactive += tk - tj;
+
+         /* Then see which of them changed. */
+         for (; tj < tk; tj++)
+         {
+            first_col = cg + tj * ts;
+            last_col = first_col + ts < lc + cg ? first_col + ts : lc + cg;
+            act[ti * tiles->ncols + tj] = 0;
+            for (i = first; i < last; i++)
+               if (memcmp(&next[(size_t)i * stride + first_col], &cur[(size_t)i * stride + first_col], 
+                          last_col - first_col))
+               {
+                  act[ti * tiles->ncols + tj] = 1;
+                  break;
+               }
+         }
+      }
+   }
+
+   /* The next step looks at what changed in this one. */
+   temp = tiles->was_changed;
+   tiles->was_changed = tiles->changed;
+   tiles->changed = temp;
+
+   phase_end(CALCULATE);
+#ifdef LOGGING
+   if ((ret = MPE_Log_event(event_num[END][CALCULATE], 0, "end calculate")))
+      MPIERR(ret);
+#endif
+
+   return 0;
+}
+
+/* Advance the game of life by one step, hiding the halo exchange
+ * behind the computation. This does the work of update_processes and
+ * calculate_next_step in split phases: the exchange is posted, the
+ * cells which don't need any ghost data are computed, and only then do
+ * we wait for the ghost data and compute the boundary ring. For
+ * checkerboard, the row exchange is hidden behind the interior of the
+ * block, and the column exchange behind the top and bottom rows. The
+ * ghost zones are one cell deep. The pieces don't overlap, so live, if
+ * not NULL, counts each cell once. The time spent waiting for ghost
+ * data is added to wait, so rebalancing can leave it out. */
+int
+overlap_next_step(struct decomp *dc, int p, int checkerboard, MPI_Datatype row_type, 
+                  MPI_Datatype col_type, unsigned char *col_bufs, int event_num[][NUM_EVENTS], 
+                  row_kernel_t row_kernel, struct pool *pool, unsigned char *cur, 
+                  unsigned char *next, int64_t *live, double *wait)
+{
+   int ln = dc->ln, lc = dc->lc;
+   MPI_Request req[4];
+   double wait_start;
+   int ret;
+
+   phase_start(CALCULATE);
+#ifdef LOGGING
+   if ((ret = MPE_Log_event(event_num[START][CALCULATE], 0, "start calculate")))
+      MPIERR(ret);
+#endif
+
+   if (live)
+      *live = 0;
+
+   /* Start sending the ghost rows. */
+   if (p > 1)
+      if ((ret = post_row_exchange(dc, checkerboard, 1, row_type, cur, req)))
+         return ret;
+
+   if (checkerboard)
+   {
+      /* The interior of the block needs no ghost data. */
+      calculate_region(checkerboard, ln, lc, 1, row_kernel, pool, cur, next, 2, ln, 2, lc, live);
+
+      /* Finish the rows, and start on the columns, which carry the
+       * corners. */
+      if (p > 1)
+      {
+         wait_start = MPI_Wtime();
+         if ((ret = MPI_Waitall(4, req, MPI_STATUSES_IGNORE)))
+            MPIERR(ret);
+         *wait += MPI_Wtime() - wait_start;
+         if ((ret = post_col_exchange(dc, 1, col_type, col_bufs, cur, req)))
+            return ret;
+      }
+
+      /* The top and bottom rows need only the ghost rows, except at
+       * their ends. */
+      calculate_region(checkerboard, ln, lc, 1, row_kernel, NULL, cur, next, 1, 2, 2, lc, live);
+      if (ln > 1)
+         calculate_region(checkerboard, ln, lc, 1, row_kernel, NULL, cur, next, ln, ln + 1, 
+                          2, lc, live);
+
+      if (p > 1)
+      {
+         wait_start = MPI_Wtime();
+         if ((ret = wait_col_exchange(dc, 1, col_bufs, cur, req)))
+            return ret;
+         *wait += MPI_Wtime() - wait_start;
+      }
+
+      /* Now the left and right columns, corners included. */
+      calculate_region(checkerboard, ln, lc, 1, row_kernel, NULL, cur, next, 1, ln + 1, 1, 2, 
+                       live);
+      if (lc > 1)
+         calculate_region(checkerboard, ln, lc, 1, row_kernel, NULL, cur, next, 1, ln + 1, 
+                          lc, lc + 1, live);
+   }
+   else
+   {
+      /* All but the first and last rows need no ghost data. */
+      calculate_region(checkerboard, ln, lc, 1, row_kernel, pool, cur, next, 2, ln, 0, lc, live);
+
+      if (p > 1)
+      {
+         wait_start = MPI_Wtime();
+         if ((ret = MPI_Waitall(4, req, MPI_STATUSES_IGNORE)))
+            MPIERR(ret);
+         *wait += MPI_Wtime() - wait_start;
+      }
+
+      calculate_region(checkerboard, ln, lc, 1, row_kernel, NULL, cur, next, 1, 2, 0, lc, live);
+      if (ln > 1)
+         calculate_region(checkerboard, ln, lc, 1, row_kernel, NULL, cur, next, ln, ln + 1, 
+                          0, lc, live);
+   }
+
+   phase_end(CALCULATE);
+#ifdef LOGGING
+   if ((ret = MPE_Log_event(event_num[END][CALCULATE], 0, "end calculate")))
+      MPIERR(ret);
+#endif
+
+   return 0;
+}
+
+/* Pack the local block into bits for a PBM file, a row at a time.
+ * Each byte of the file is written by the processor holding its first
+ * cell, so bytes starting in this block go to buf, nown of them for
+ * each row, and the bits of a byte which starts in the block to the
+ * left are sent there, to be added to its last byte. Blocks must be
+ * at least 8 columns wide, so a byte is never split three ways. */
+int
+pack_pbm(struct decomp *dc, int checkerboard, int ghost, unsigned char *cur, 
+         unsigned char *buf)
+{
+   int stride = checkerboard ? dc->lc + 2 * ghost : dc->lc;
+   int first = (dc->col0 + 7) / 8, nown = (dc->col0 + dc->lc - 1) / 8 - first + 1;
+   int send_count, recv_count;
+   unsigned char *row, *edge_out, *edge_in;
+   int i, j, c;
+   int ret;
+
+   if (!(edge_out = calloc(dc->ln, 1)) || !(edge_in = calloc(dc->ln, 1)))
+      return ERR_DUMB;
+   memset(buf, 0, (size_t)dc->ln * nown);
+   for (i = 0; i < dc->ln; i++)
+   {
+      row = &cur[(size_t)(ghost + i) * stride + (checkerboard ? ghost : 0)];
+      for (j = 0; j < dc->lc; j++)
+         if (row[j])
+         {
+            c = dc->col0 + j;
+            if (c / 8 < first)
+               edge_out[i] |= 1 << (7 - c % 8);
+            else
+               buf[(size_t)i * nown + c / 8 - first] |= 1 << (7 - c % 8);
+         }
+   }
+
+   /* Send our part of the left neighbor's last byte, and get the right
+    * neighbor's part of ours. */
+   send_count = dc->col0 % 8 ? dc->ln : 0;
+   recv_count = dc->right != MPI_PROC_NULL && (dc->col0 + dc->lc) % 8 ? dc->ln : 0;
+   if ((ret = MPI_Sendrecv(edge_out, send_count, MPI_BYTE, dc->left, 0, edge_in, recv_count, 
+                           MPI_BYTE, dc->right, 0, dc->comm, MPI_STATUS_IGNORE)))
+      MPIERR(ret);
+   if (recv_count)
+      for (i = 0; i < dc->ln; i++)
+         buf[(size_t)i * nown + nown - 1] |= edge_in[i];
+
+   free(edge_out);
+   free(edge_in);
+
+   return 0;
+}
+
+/* Get ready to write up to max snapshots in the background. With max
+ * of zero, snapshots are written before write_output returns. */
+int
+init_snapshots(int max, struct snapshots *snaps)
+{
+   snaps->max = max;
+   snaps->first = snaps->n = 0;
+   if (!max)
+      return 0;
+   if (!(snaps->fh = calloc(max, sizeof(MPI_File))) || 
+       !(snaps->req = calloc(max, sizeof(MPI_Request))) ||
+       !(snaps->buf = calloc(max, sizeof(unsigned char *))) || 
+       !(snaps->buf_size = calloc(max, sizeof(size_t))))
+      return ERR_DUMB;
+
+   return 0;
+}
+
+/* Wait for the oldest snapshot to be written, and close its file. All
+ * processors finish snapshots in the same order, since closing the
+ * file is collective. */
+int
+finish_snapshot(struct snapshots *snaps)
+{
+   int ret;
+
+   if ((ret = MPI_Wait(&snaps->req[snaps->first], MPI_STATUS_IGNORE)))
+      MPIERR(ret);
+   if ((ret = MPI_File_close(&snaps->fh[snaps->first])))
+      MPIERR(ret);
+   snaps->first = (snaps->first + 1) % snaps->max;
+   snaps->n--;
+
+   return 0;
+}
+
+/* Finish all the snapshots, and free the buffers. */
+int
+finish_snapshots(struct snapshots *snaps)
+{
+   int i, ret;
+
+   if (!snaps->max)
+      return 0;
+   while (snaps->n)
+      if ((ret = finish_snapshot(snaps)))
+         return ret;
+   for (i = 0; i < snaps->max; i++)
+      free(snaps->buf[i]);
+   free(snaps->fh);
+   free(snaps->req);
+   free(snaps->buf);
+   free(snaps->buf_size);
+
+   return 0;
+}
+
+/* Open the series file for this run, ann/out_<p>.gol, which will hold
+ * every generation that is output. After a header of
+ * SERIES_HEADER_BYTES comes one frame per generation, either a
+ * keyframe, the whole board packed as in a PBM file, or a delta, the
+ * cells which changed since the last frame as run lengths. A delta is
+ * made of parts, one from each processor with changes, each a count
+ * of changed cells and then, for each one, how many cells (in the
+ * order row * cols + col) come between it and the last changed cell
+ * of the part, or the start of the board for the first. All of these
+ * are unsigned varints, 7 bits to a byte, low bits first, with the top
+ * bit set on all but the last byte. Most runs are short, so a changed
+ * cell usually takes a byte or two. At the end is the index of frames,
+ * SERIES_INDEX_WORDS 64-bit words for each: the generation, the offset
+ * of the frame, whether it is a keyframe, and its length in bytes. The
+ * header is SERIES_MAGIC, and then the rows, cols, frames between
+ * keyframes, number of frames and offset of the index, as 64-bit
+ * words. Everything but the varints is in the native byte order. */
+int
+init_series(struct decomp *dc, int p, int key_every, struct series *series)
+{
+   char file_name[128];
+   int ret;
+
+   if (key_every < 1)
+      return ERR_ARG;
+   sprintf(file_name, "ann/out_%d.gol", p);
+   MPI_File_delete(file_name, MPI_INFO_NULL);
+   if ((ret = MPI_File_open(MPI_COMM_WORLD, file_name, MPI_MODE_CREATE|MPI_MODE_RDWR, 
+                            MPI_INFO_NULL, &series->fh)))
+      MPIERR(ret);
+   series->key_every = key_every;
+   series->nframes = series->max_frames = 0;
+   series->end = SERIES_HEADER_BYTES;
+   series->index = NULL;
+   series->prev = series->bits = series->changes = NULL;
+   series->changes_size = 0;
+   series->row0 = series->ln = -1;
+
+   return 0;
+}
+
+/* Encode v as a varint at buf, returning the number of bytes used,
+ * at most SERIES_VARINT_MAX. */
+int
+put_varint(uint64_t v, unsigned char *buf)
+{
+   int n = 0;
+
+   while (v >= 0x80)
+   {
+      buf[n++] = (unsigned char)(v | 0x80);
+      v >>= 7;
+   }
+   buf[n++] = (unsigned char)v;
+
+   return n;
+}
+
+/* Add generation s, in the local grid cur, to the series. A keyframe
+ * is written every key_every frames, when the band of rows has moved
+ * since the last frame, and when the delta would be no smaller. */
+int
+write_series(struct decomp *dc, int my_rank, int s, int checkerboard, int ghost, 
+             int verbose, int event_num[][NUM_EVENTS], struct series *series, 
+             unsigned char *cur)
+{
+   int stride = checkerboard ? dc->lc + 2 * ghost : dc->lc;
+   long long n = SERIES_VARINT_MAX, total = 0, start = 0, key_bytes, count = 0;
+   int key = 0;
+   unsigned char *row, *prev, *part = NULL;
+   unsigned char head[SERIES_VARINT_MAX];
+   uint64_t cell, last = 0;
+   int i, j, len, ret;
+
+   phase_start(WRITE);
+#ifdef LOGGING
+   if ((ret = MPE_Log_event(event_num[START][WRITE], 0, "start write")))
+      MPIERR(ret);
+#endif
+
+   /* A new band needs new types and a new copy of the last frame. */
+   if (dc->row0 != series->row0 || dc->ln != series->ln)
+   {
+      if (series->ln >= 0)
+      {
+         MPI_Type_free(&series->filetype);
+         MPI_Type_free(&series->memtype);
+      }
+      if (create_mpi_types(dc, checkerboard, ghost, PBM_RAW, &series->filetype, 
+                           &series->memtype))
+         return ERR_WRITE;
+      free(series->prev);
+      free(series->bits);
+      if (!(series->prev = malloc((size_t)dc->ln * dc->lc)) ||
+          !(series->bits = malloc((size_t)dc->ln * ((dc->col0 + dc->lc - 1) / 8 - 
+                                                    (dc->col0 + 7) / 8 + 1))))
+         return ERR_DUMB;
+      series->row0 = dc->row0;
+      series->ln = dc->ln;
+      key++;
+   }
+   key_bytes = (long long)dc->rows * ((dc->cols + 7) / 8);
+   if (!(series->nframes % series->key_every))
+      key++;
+   if ((ret = MPI_Allreduce(MPI_IN_PLACE, &key, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD)))
+      MPIERR(ret);
+
+   /* Find the cells which changed, and encode the runs between them
+    * after room for the count. Within a processor's part of the board
+    * the cells come in increasing order. */
+   if (!key)
+   {
+      for (i = 0; i < dc->ln; i++)
+      {
+         row = &cur[(size_t)(ghost + i) * stride + (checkerboard ? ghost : 0)];
+         prev = &series->prev[(size_t)i * dc->lc];
+         for (j = 0; j < dc->lc; j++)
+            if (!row[j] != !prev[j])
+            {
+               if (n + SERIES_VARINT_MAX > series->changes_size)
+               {
+                  series->changes_size = series->changes_size ? 2 * series->changes_size : 4096;
+                  if (!(series->changes = realloc(series->changes, series->changes_size)))
+                     return ERR_DUMB;
+               }
+               cell = (uint64_t)(dc->row0 + i) * dc->cols + dc->col0 + j;
+               n += put_varint(cell - last, &series->changes[n]);
+               last = cell + 1;
+               count++;
+            }
+      }
+
+      /* Put the count just before the runs. A processor with no
+       * changes writes nothing. */
+      if (count)
+      {
+         len = put_varint(count, head);
+         part = &series->changes[SERIES_VARINT_MAX - len];
+         memcpy(part, head, len);
+         n -= SERIES_VARINT_MAX - len;
+      }
+      else
+         n = 0;
+      if ((ret = MPI_Allreduce(&n, &total, 1, MPI_LONG_LONG, MPI_SUM, MPI_COMM_WORLD)))
+         MPIERR(ret);
+      if (total >= key_bytes)
+         key++;
+   }
+
+   if (key)
+   {
+      /* Write the whole board, through the PBM file view. */
+      if ((ret = pack_pbm(dc, checkerboard, ghost, cur, series->bits)))
+         return ret;
+      if ((ret = MPI_File_set_view(series->fh, series->end, MPI_BYTE, series->filetype, 
+                                   "native", MPI_INFO_NULL)))
+         MPIERR(ret);
+      if ((ret = MPI_File_write_all(series->fh, series->bits, 1, series->memtype, 
+                                    MPI_STATUS_IGNORE)))
+         MPIERR(ret);
+      if ((ret = MPI_File_set_view(series->fh, 0, MPI_BYTE, MPI_BYTE, "native", 
+                                   MPI_INFO_NULL)))
+         MPIERR(ret);
+      total = key_bytes;
+   }
+   else
+   {
+      /* Each processor writes its part after those of the processors
+       * before it. A part is smaller than the keyframe would be, so
+       * its length fits in an int. */
+      if ((ret = MPI_Exscan(&n, &start, 1, MPI_LONG_LONG, MPI_SUM, MPI_COMM_WORLD)))
+         MPIERR(ret);
+      if (!my_rank)
+         start = 0;
+      if ((ret = MPI_File_write_at_all(series->fh, series->end + start, 
+                                       part, (int)n, MPI_BYTE, 
+                                       MPI_STATUS_IGNORE)))
+         MPIERR(ret);
+   }
+   if (verbose && !my_rank)
+      printf("series frame %d, step %d: %s of %lld bytes\n", series->nframes, s, 
+             key ? "keyframe" : "changes", total);
+
+   /* Remember this generation, for the next delta. */
+   for (i = 0; i < dc->ln; i++)
+      memcpy(&series->prev[(size_t)i * dc->lc], 
+             &cur[(size_t)(ghost + i) * stride + (checkerboard ? ghost : 0)], dc->lc);
+
+   /* Processor 0 keeps the index. */
+   if (!my_rank)
+   {
+      if (series->nframes == series->max_frames)
+      {
+         series->max_frames = series->max_frames ? 2 * series->max_frames : 1024;
+         if (!(series->index = realloc(series->index, series->max_frames * 
+                                       SERIES_INDEX_WORDS * sizeof(int64_t))))
+            return ERR_DUMB;
+      }
+      series->index[series->nframes * SERIES_INDEX_WORDS] = s;
+      series->index[series->nframes * SERIES_INDEX_WORDS + 1] = series->end;
+      series->index[series->nframes * SERIES_INDEX_WORDS + 2] = key ? 1 : 0;
+      series->index[series->nframes * SERIES_INDEX_WORDS + 3] = total;
+   }
+   series->end += total;
+   series->nframes++;
+
+   phase_end(WRITE);
+#ifdef LOGGING
+   if ((ret = MPE_Log_event(event_num[END][WRITE], 0, "end write")))
+      MPIERR(ret);
+#endif
+
+   return 0;
+}
+
+/* Write the index and the header, and close the series file. */
+int
+finish_series(struct decomp *dc, int my_rank, struct series *series)
+{
+   int64_t header[SERIES_HEADER_WORDS];
+   int ret;
+
+   if (!my_rank)
+   {
+      if ((ret = MPI_File_write_at(series->fh, series->end, series->index, 
+                                   series->nframes * SERIES_INDEX_WORDS, MPI_INT64_T, 
+                                   MPI_STATUS_IGNORE)))
+         MPIERR(ret);
+      memcpy(header, SERIES_MAGIC, sizeof(int64_t));
+      header[1] = dc->rows;
+      header[2] = dc->cols;
+      header[3] = series->key_every;
+      header[4] = series->nframes;
+      header[5] = series->end;
+      if ((ret = MPI_File_write_at(series->fh, 0, header, SERIES_HEADER_WORDS, MPI_INT64_T, 
+                                   MPI_STATUS_IGNORE)))
+         MPIERR(ret);
+   }
+   if ((ret = MPI_File_close(&series->fh)))
+      MPIERR(ret);
+   if (series->ln >= 0)
+   {
+      MPI_Type_free(&series->filetype);
+      MPI_Type_free(&series->memtype);
+   }
+   free(series->index);
+   free(series->prev);
+   free(series->bits);
+   free(series->changes);
+
+   return 0;
+}
+
+/* Write the game data for the current generation to a PGM output
+ * file, which can be understood by many programs - GIMP, for
+ * example. With format PBM_RAW, write a PBM file instead, with a bit
+ * per cell, using the types made for it by create_mpi_types, and with
+ * SERIES_FILE, add a frame to the series file. If snaps
+ * allows snapshots in flight, the grid is copied to a buffer of its
+ * own, and written with a non-blocking collective write, so the next
+ * generation can be computed while this one goes to disk. When max
+ * snapshots are already in flight, we first wait for the oldest. The
+ * bit engine passes its grid in pbuf, to be written a band of
+ * band_rows rows at a time through cur, by write_packed_rows. */
+int
+write_output(int p, struct decomp *dc, int my_rank, int s, int checkerboard, int ghost, 
+             int format, MPI_Datatype filetype, MPI_Datatype memtype, int verbose, 
+             int event_num[][NUM_EVENTS], struct snapshots *snaps, struct series *series, 
+             uint64_t *pbuf, int band_rows, unsigned char *cur)
+{
+   int header_bytes;
+   MPI_File out_fh;
+   char output_file[128], hdr[128];
+   unsigned char *buf = cur;
+   size_t buf_size;
+   int slot = 0;
+   int ret;
+
+   /* A series file gets one more frame. */
+   if (format == SERIES_FILE)
+      return write_series(dc, my_rank, s, checkerboard, ghost, verbose, event_num, series, 
+                          cur);
+
+   phase_start(WRITE);
+#ifdef LOGGING
+   if ((ret = MPE_Log_event(event_num[START][WRITE], 0, "start write")))
+      MPIERR(ret);
+#endif
+
+   /* Make room for this snapshot. */
+   if (snaps->max)
+   {
+      if (snaps->n == snaps->max)
+         if ((ret = finish_snapshot(snaps)))
+            return ret;
+      slot = (snaps->first + snaps->n) % snaps->max;
+   }
+
+   /* Delete and then create output file. */
+   sprintf(output_file, "ann/out_%d_%d.%s", p, s, format == PBM_RAW ? "pbm" : "pgm");
+   if (verbose && !my_rank)
+      printf("output %s, s=%d\n", output_file, s);
+   MPI_File_delete(output_file, MPI_INFO_NULL);
+   if ((ret = MPI_File_open(MPI_COMM_WORLD, output_file, MPI_MODE_CREATE|MPI_MODE_RDWR, 
+                            MPI_INFO_NULL, &out_fh)))
+      MPIERR(ret);
+
+   /* Create header info, and have process 0 write it to the file. */
+   if (format == PBM_RAW)
+      sprintf(hdr, "P4\n%d %d\n", dc->cols, dc->rows);
+   else
+      sprintf(hdr, "P5\n%d %d\n255\n", dc->cols, dc->rows);
+   header_bytes = strlen(hdr);
+   if ((ret = MPI_File_write_all(out_fh, hdr, header_bytes, MPI_BYTE, MPI_STATUS_IGNORE)))
+      MPIERR(ret);
+
+   if (pbuf)
+   {
+      if ((ret = write_packed_rows(dc, out_fh, header_bytes, checkerboard, format, band_rows, 
+                                   pbuf, cur)))
+         return ret;
+      if ((ret = MPI_File_close(&out_fh)))
+         MPIERR(ret);
+      phase_end(WRITE);
+#ifdef LOGGING
+      if ((ret = MPE_Log_event(event_num[END][WRITE], 0, "end write")))
+         MPIERR(ret);
+#endif
+      return 0;
+   }
+         
+   /* Set the file view to translate our memory data into the file's data layout. */
+   MPI_File_set_view(out_fh, header_bytes, MPI_BYTE, filetype, "native", MPI_INFO_NULL);
+
+   /* Find the buffer to write from: the packed bits for PBM, and, for
+    * a snapshot in flight, a copy of the grid. */
+   if (format == PBM_RAW)
+      buf_size = (size_t)dc->ln * ((dc->col0 + dc->lc - 1) / 8 - (dc->col0 + 7) / 8 + 1);
+   else
+      buf_size = (size_t)(dc->ln + 2 * ghost) * (checkerboard ? dc->lc + 2 * ghost : dc->lc);
+   if (snaps->max)
+   {
+      if (snaps->buf_size[slot] < buf_size)
+      {
+         free(snaps->buf[slot]);
+         if (!(snaps->buf[slot] = malloc(buf_size)))
+            return ERR_DUMB;
+         snaps->buf_size[slot] = buf_size;
+      }
+      buf = snaps->buf[slot];
+   }
+   else if (format == PBM_RAW && !(buf = malloc(buf_size)))
+      return ERR_DUMB;
+   if (format == PBM_RAW)
+   {
+      if ((ret = pack_pbm(dc, checkerboard, ghost, cur, buf)))
+         return ret;
+   }
+   else if (buf != cur)
+      memcpy(buf, cur, buf_size);
+
+   /* Write the output. */
+   if (snaps->max)
+   {
+      snaps->fh[slot] = out_fh;
+      if ((ret = MPI_File_iwrite_all(out_fh, buf, 1, memtype, &snaps->req[slot])))
+         MPIERR(ret);
+      snaps->n++;
+   }
+   else
+   {
+      MPI_File_write_all(out_fh, buf, 1, memtype, MPI_STATUS_IGNORE);
+      if (buf != cur)
+         free(buf);
+      if ((ret = MPI_File_close(&out_fh)))
+         MPIERR(ret);
+   }
+
+   phase_end(WRITE);
+#ifdef LOGGING
+   if ((ret = MPE_Log_event(event_num[END][WRITE], 0, "end write")))
+      MPIERR(ret);
+#endif
+
+   return 0;
+}
+
+/* Write a checkpoint of the board in cur, after step s of num_steps.
+ * It can be read back as an input file, with any number of processors
+ * and decomposition, to carry on from step s + 1. The checkpoint is a
+ * PBM file, written with the types made for PBM by create_mpi_types,
+ * to CKPT_TMP_FILE, and renamed to CKPT_FILE once it is complete, so
+ * a crash while writing leaves the last checkpoint alone. The rule
+ * goes in the header too, as it changes what comes after. The bit
+ * engine passes its grid in pbuf, to be written a band of band_rows
+ * rows at a time through cur. */
+int
+write_checkpoint(struct decomp *dc, int my_rank, int s, int num_steps, int checkerboard, 
+                 int ghost, MPI_Datatype filetype, MPI_Datatype memtype, uint64_t *pbuf, 
+                 int band_rows, unsigned char *cur)
+{
+   MPI_File fh;
+   char hdr[128], text[2 * (MAX_NEIGHBORS + 2) + 2];
+   unsigned char *buf = NULL;
+   int header_bytes, failed;
+   int ret;
+
+   if (!pbuf)
+   {
+      if (!(buf = malloc((size_t)dc->ln * ((dc->col0 + dc->lc - 1) / 8 - 
+                                           (dc->col0 + 7) / 8 + 1))))
+         return ERR_DUMB;
+      if ((ret = pack_pbm(dc, checkerboard, ghost, cur, buf)))
+      {
+         free(buf);
+         return ret;
+      }
+   }
+
+   /* Processor 0 clears away any half written file, before anyone
+    * opens it. */
+   if (!my_rank)
+      MPI_File_delete(CKPT_TMP_FILE, MPI_INFO_NULL);
+   if ((ret = MPI_Barrier(MPI_COMM_WORLD)))
+      MPIERR(ret);
+   if ((ret = MPI_File_open(MPI_COMM_WORLD, CKPT_TMP_FILE, MPI_MODE_CREATE|MPI_MODE_RDWR, 
+                            MPI_INFO_NULL, &fh)))
+      MPIERR(ret);
+   format_rule(&rule, text);
+   sprintf(hdr, "P4\n# " CKPT_COMMENT "\n%d %d\n", s, num_steps, text, dc->cols, dc->rows);
+   header_bytes = strlen(hdr);
+   if (!my_rank)
+      if ((ret = MPI_File_write_at(fh, 0, hdr, header_bytes, MPI_BYTE, MPI_STATUS_IGNORE)))
+         MPIERR(ret);
+   if (pbuf)
+   {
+      if ((ret = write_packed_rows(dc, fh, header_bytes, checkerboard, PBM_RAW, band_rows, 
+                                   pbuf, cur)))
+         return ret;
+   }
+   else
+   {
+      if ((ret = MPI_File_set_view(fh, header_bytes, MPI_BYTE, filetype, "native", 
+                                   MPI_INFO_NULL)))
+         MPIERR(ret);
+      if ((ret = MPI_File_write_all(fh, buf, 1, memtype, MPI_STATUS_IGNORE)))
+         MPIERR(ret);
+   }
+   if ((ret = MPI_File_close(&fh)))
+      MPIERR(ret);
+   free(buf);
+
+   /* Everyone waits for the rename, and learns whether it worked. */
+   failed = !my_rank && rename(CKPT_TMP_FILE, CKPT_FILE);
+   if ((ret = MPI_Bcast(&failed, 1, MPI_INT, 0, MPI_COMM_WORLD)))
+      MPIERR(ret);
+
+   return failed ? ERR_WRITE : 0;
+}
+
+/* Move on to the next generation. */
+int
+swap_buffers(int ln, int lc, int checkerboard, int ghost, int event_num[][NUM_EVENTS], 
+             struct pool *pool, struct tiles *tiles, unsigned char **cur, 
+             unsigned char **next)
+{
+   unsigned char *temp;
+   int i;
+#ifdef LOGGING
+   int ret;
+#endif
+
+   phase_start(SWAP);
+#ifdef LOGGING
+   if ((ret = MPE_Log_event(event_num[START][SWAP], 0, "start swap")))
+      MPIERR(ret);
+#endif
+
+   /* Swap the buffers. */
+   temp = *cur;
+   *cur = *next;
+   *next = temp;
+
+   /* Reinitialize for the next generation. With active tiles, the old
+    * generation is kept for the tiles which are still, and only the
+    * ghost zones are cleared. */
+   if (tiles)
+   {
+      clear_rows(checkerboard, ln, lc, ghost, *next, 0, ghost);
+      clear_rows(checkerboard, ln, lc, ghost, *next, ln + ghost, ln + 2 * ghost);
+      if (checkerboard)
+         for (i = ghost; i < ln + ghost; i++)
+         {
+            memset(&(*next)[(size_t)i * (lc + 2 * ghost)], 0, ghost);
+            memset(&(*next)[(size_t)i * (lc + 2 * ghost) + lc + ghost], 0, ghost);
+         }
+   }
+   else if (pool)
+   {
+      pool->next = *next;
+      run_pool(pool, JOB_CLEAR, 0, ln + 2 * ghost, 0, 0);
+   }
+   else
+      clear_rows(checkerboard, ln, lc, ghost, *next, 0, ln + 2 * ghost);
+
+   phase_end(SWAP);
+#ifdef LOGGING
+      if ((ret = MPE_Log_event(event_num[END][SWAP], 0, "end swap")))
+         MPIERR(ret);
+#endif
+
+   return 0;
+}
+
+/* Find the part of total rows (or columns) that falls to block i of
+ * parts. When parts does not divide total, the first total % parts
+ * blocks get one extra. */
+void
+block_range(int total, int parts, int i, int *start, int *len)
+{
+   int base = total / parts, extra = total % parts;
+
+   *len = base + (i < extra);
+   *start = i * base + (i < extra ? i : extra);
+}
+
+/* We need two grids, one for the current generation, and one for the
+ * next generation. The size of the local buffers depends on the total
+ * size of the playing field (rows by cols), the number of processors
+ * (p), and the data decomposition method. This function sets up the
+ * decomposition dc, with a Cartesian communicator, and allocates the
+ * cur and next buffers, with ghost zones ghost cells deep. With more
+ * than one thread per processor, it also splits the ln local rows
+ * into tiles of tile_rows rows, a few per thread. */   
+int
+init_grid(int p, int rows, int cols, int checkerboard, int q, int ghost, int nthreads, 
+          struct decomp *dc, int *tile_rows, unsigned char **cur, unsigned char **next)
+{
+   int periods[NDIMS] = {0, 0};
+   size_t buf_size;
+   int my_rank;
+   int ret;
+
+   /* Choose the shape of the processor grid. For checkerboard, let MPI
+    * find the most nearly square grid, unless the user asked for q
+    * columns of processors. Row decomposition has just one column. */
+   dc->dims[0] = 0;
+   dc->dims[1] = checkerboard ? q : 1;
+   if (dc->dims[1] < 0 || (dc->dims[1] && p % dc->dims[1]))
+      return ERR_ARG;
+   if ((ret = MPI_Dims_create(p, NDIMS, dc->dims)))
+      MPIERR(ret);
+
+   /* Build the Cartesian communicator. Ranks are not reordered, so they
+    * are the same as in MPI_COMM_WORLD. */
+   if ((ret = MPI_Cart_create(MPI_COMM_WORLD, NDIMS, dc->dims, periods, 0, &dc->comm)))
+      MPIERR(ret);
+   if ((ret = MPI_Comm_rank(dc->comm, &my_rank)))
+      MPIERR(ret);
+   if ((ret = MPI_Cart_coords(dc->comm, my_rank, NDIMS, dc->coords)))
+      MPIERR(ret);
+   if ((ret = MPI_Cart_shift(dc->comm, 0, 1, &dc->up, &dc->down)))
+      MPIERR(ret);
+   if ((ret = MPI_Cart_shift(dc->comm, 1, 1, &dc->left, &dc->right)))
+      MPIERR(ret);
+
+   /* Determine local grid size, with the remainder rows and columns
+    * spread over the first processors. */
+   dc->rows = rows;
+   dc->cols = cols;
+   block_range(rows, dc->dims[0], dc->coords[0], &dc->row0, &dc->ln);
+   block_range(cols, dc->dims[1], dc->coords[1], &dc->col0, &dc->lc);
+
+   /* Extra space for ghost rows, and for checkerboard, colums. */
+   if (checkerboard)
+      buf_size = (size_t)(dc->ln + 2 * ghost) * (dc->lc + 2 * ghost);
+   else
+      buf_size = (size_t)(dc->ln + 2 * ghost) * dc->lc;
+
+   /* Ghost zones can't be deeper than the neighbor's real data. The
+    * smallest block is rows / dims[0] rows (or cols / dims[1] columns). */
+   if (ghost < 1 || ghost > rows / dc->dims[0])
+      return ERR_ARG;
+   if (checkerboard && ghost > cols / dc->dims[1])
+      return ERR_ARG;
+
+   /* Every thread needs at least one row to work on. */
+   if (nthreads < 1 || nthreads > rows / dc->dims[0])
+      return ERR_ARG;
+   *tile_rows = (dc->ln + nthreads * TILES_PER_THREAD - 1) / (nthreads * TILES_PER_THREAD);
+
+   /* We will need two grids, one for the current timestep, one for
+    * the next timestep. Using calloc causes all ghost rows (and
+    * columns) to be initialized to zero. The stream engine keeps its
+    * grids in files, and passes no cur. */
+   if (!cur)
+      return 0;
+   if (!(*cur = calloc(buf_size, 1)))
+      return ERR_DUMB;
+   if (!(*next = calloc(buf_size, 1)))
+      return ERR_DUMB;
+
+   return 0;
+}
+
+/* Move the row bands between processors so that each gets about the
+ * same share of the work. The work is measured by calc_time, the time
+ * each processor spent computing since the last rebalance, with every
+ * row of a processor taken to cost the same. No band gets fewer than
+ * min_rows rows. The new bands are only used if they are expected to
+ * cut the longest compute time by at least min_gain percent, since
+ * moving rows is not free. If they are, the rows are moved to their
+ * new owners, cur and next are reallocated, and *moved is set. Ghost
+ * rows are not moved, the caller must exchange them again. */
+int
+rebalance(struct decomp *dc, int my_rank, int p, int ghost, int min_rows, 
+          int min_gain, double calc_time, int verbose, int *moved, unsigned char **cur, 
+          unsigned char **next)
+{
+   double *times, *cost, target, acc, old_max, new_max;
+   int *old_row0, *old_ln, *new_row0, *new_ln;
+   int *send_counts, *send_displs, *recv_counts, *recv_displs;
+   unsigned char *new_cur, *new_next;
+   MPI_Datatype row_type;
+   int rows = dc->rows, lc = dc->lc;
+   int i, r, n, start, end;
+   int ret;
+
+   /* The arrays are carved out of two blocks, one of doubles and one
+    * of ints, so there is less to free if we run out of memory. */
+   *moved = 0;
+   if (!(times = malloc((p + (size_t)rows) * sizeof(double))))
+      return ERR_DUMB;
+   if (!(old_row0 = malloc(8 * (size_t)p * sizeof(int))))
+   {
+      free(times);
+      return ERR_DUMB;
+   }
+   cost = times + p;
+   old_ln = old_row0 + p;
+   new_row0 = old_ln + p;
+   new_ln = new_row0 + p;
+   send_counts = new_ln + p;
+   send_displs = send_counts + p;
+   recv_counts = send_displs + p;
+   recv_displs = recv_counts + p;
+
+   /* Everyone learns everyone's time and band, and so comes up with
+    * the same new bands. */
+   if ((ret = MPI_Allgather(&calc_time, 1, MPI_DOUBLE, times, 1, MPI_DOUBLE, dc->comm)))
+      MPIERR(ret);
+   if ((ret = MPI_Allgather(&dc->ln, 1, MPI_INT, old_ln, 1, MPI_INT, dc->comm)))
+      MPIERR(ret);
+   for (i = 0, r = 0, old_max = 0; i < p; r += old_ln[i++])
+   {
+      old_row0[i] = r;
+      for (n = r; n < r + old_ln[i]; n++)
+         cost[n] = times[i] / old_ln[i];
+      if (times[i] > old_max)
+         old_max = times[i];
+   }
+
+   /* Give each processor rows until it has its share of the total
+    * cost, leaving enough for the processors after it. */
+   for (r = 0, target = 0; r < rows; r++)
+      target += cost[r] / p;
+   for (i = 0, r = 0, acc = 0, new_max = 0; i < p; i++)
+   {
+      double mine = 0;
+
+      new_row0[i] = r;
+      for (n = 0; r < rows - min_rows * (p - 1 - i) &&
+              (i == p - 1 || n < min_rows || acc + cost[r] / 2 <= (i + 1) * target); n++, r++)
+      {
+         acc += cost[r];
+         mine += cost[r];
+      }
+      new_ln[i] = n;
+      if (mine > new_max)
+         new_max = mine;
+   }
+
+   if (verbose && !my_rank)
+      printf("rebalance: longest compute time %f, expected %f with new bands\n", 
+             old_max, new_max);
+
+   /* Is it worth it? If so, each processor sends the part of its old
+    * band that lies in each new band to the new owner. Rows are the
+    * whole width of the board, so counts and displacements are in
+    * rows, which keeps them in an int however wide the board is. */
+   if (new_max < old_max && new_max <= old_max * (100 - min_gain) / 100)
+   {
+      for (i = 0; i < p; i++)
+      {
+         start = old_row0[my_rank] > new_row0[i] ? old_row0[my_rank] : new_row0[i];
+         end = old_row0[my_rank] + old_ln[my_rank];
+         if (new_row0[i] + new_ln[i] < end)
+            end = new_row0[i] + new_ln[i];
+         send_counts[i] = end > start ? end - start : 0;
+         send_displs[i] = end > start ? start - old_row0[my_rank] + ghost : 0;
+         start = old_row0[i] > new_row0[my_rank] ? old_row0[i] : new_row0[my_rank];
+         end = old_row0[i] + old_ln[i];
+         if (new_row0[my_rank] + new_ln[my_rank] < end)
+            end = new_row0[my_rank] + new_ln[my_rank];
+         recv_counts[i] = end > start ? end - start : 0;
+         recv_displs[i] = end > start ? start - new_row0[my_rank] + ghost : 0;
+      }
+
+      if (!(new_cur = calloc((size_t)(new_ln[my_rank] + 2 * ghost) * lc, 1)) ||
+          !(new_next = calloc((size_t)(new_ln[my_rank] + 2 * ghost) * lc, 1)))
+      {
+         free(new_cur);
+         free(times);
+         free(old_row0);
+         return ERR_DUMB;
+      }
+      if ((ret = MPI_Type_contiguous(lc, MPI_BYTE, &row_type)))
+         MPIERR(ret);
+      if ((ret = MPI_Type_commit(&row_type)))
+         MPIERR(ret);
+      if ((ret = MPI_Alltoallv(*cur, send_counts, send_displs, row_type, new_cur, recv_counts, 
+                               recv_displs, row_type, dc->comm)))
+         MPIERR(ret);
+      if ((ret = MPI_Type_free(&row_type)))
+         MPIERR(ret);
+      free(*cur);
+      free(*next);
+      *cur = new_cur;
+      *next = new_next;
+
+      dc->row0 = new_row0[my_rank];
+      dc->ln = new_ln[my_rank];
+      *moved = 1;
+
+      if (verbose > 1)
+         printf("%d: rebalanced to rows %d to %d\n", my_rank, dc->row0, dc->row0 + dc->ln - 1);
+   }
+
+   free(times);
+   free(old_row0);
+
+   return 0;
+}
+
+/* How many words are needed to hold one local row of the bit-packed
+ * grid, including the two ghost columns? */
+int
+packed_row_words(int width)
+{
+   return (width + 2 + CELLS_PER_WORD - 1) / CELLS_PER_WORD;
+}
+
+/* Count the set bits in a word. */
+int
+pop_count(uint64_t x)
+{
+#ifdef __GNUC__
+   return __builtin_popcountll(x);
+#else
+   int bits;
+   for (bits = 0; x; x &= x - 1)
+      bits++;
+   return bits;
+#endif
+}
+
+/* Return the bits of word w of a packed row that hold real cells,
+ * that is, everything but the ghost columns and the padding after the
+ * right ghost column. */
+uint64_t
+interior_mask(int w, int width)
+{
+   uint64_t mask = ~(uint64_t)0;
+   int hi = width + 1 - w * CELLS_PER_WORD;
+
+   if (!w)
+      mask &= ~(uint64_t)1;
+   if (hi <= 0)
+      mask = 0;
+   else if (hi < CELLS_PER_WORD)
+      mask &= ((uint64_t)1 << hi) - 1;
+   return mask;
+}
+
+/* Allocate the cur and next grids for the bit engine. The local grid
+ * has ln + 2 rows of packed_row_words(width) words, where width is the
+ * number of real cells in a local row: lc for checkerboard, cols for
+ * row decomposition. */
+int
+init_packed_grid(int ln, int width, uint64_t **pcur, uint64_t **pnext)
+{
+   size_t buf_words = (size_t)(ln + 2) * packed_row_words(width);
+
+   /* As with the byte grids, calloc zeros the ghost rows and columns. */
+   if (!(*pcur = calloc(buf_words, sizeof(uint64_t))))
+      return ERR_DUMB;
+   if (!(*pnext = calloc(buf_words, sizeof(uint64_t))))
+      return ERR_DUMB;
+
+   return 0;
+}
+
+/* Pack n rows of a byte grid (as filled by init_cur) into the same
+ * rows of a bit grid, where buf and pbuf point to the first of them.
+ * Any non-zero byte is a live cell. The byte grid for row
+ * decomposition has no ghost columns, so its column j becomes packed
+ * column j + 1. */
+int
+pack_rows(int checkerboard, int lc, int n, unsigned char *buf, uint64_t *pbuf)
+{
+   size_t wpr = packed_row_words(lc);
+   int stride = checkerboard ? lc + 2 : lc;
+   int i, j, c;
+
+   memset(pbuf, 0, n * wpr * sizeof(uint64_t));
+   for (i = 0; i < n; i++)
+      for (j = 0; j < stride; j++)
+         if (buf[(size_t)i * stride + j])
+         {
+            c = checkerboard ? j : j + 1;
+            pbuf[i * wpr + c / CELLS_PER_WORD] |= (uint64_t)1 << (c % CELLS_PER_WORD);
+         }
+
+   return 0;
+}
+
+/* Unpack n rows of a bit grid into a byte grid, with live cells set to
+ * 255 as the byte engine does. This is used to hand the board to
+ * write_output, a band or all of it at a time. */
+int
+unpack_rows(int checkerboard, int lc, int n, uint64_t *pbuf, unsigned char *buf)
+{
+   size_t wpr = packed_row_words(lc);
+   int stride = checkerboard ? lc + 2 : lc;
+   int i, j, c;
+
+   for (i = 0; i < n; i++)
+      for (j = 0; j < stride; j++)
+      {
+         c = checkerboard ? j : j + 1;
+         buf[(size_t)i * stride + j] = 
+            (pbuf[i * wpr + c / CELLS_PER_WORD] >> (c % CELLS_PER_WORD)) & 1 ? 255 : 0;
+      }
+
+   return 0;
+}
+
+/* Read the board for the bit engine straight into the packed grid
+ * pbuf, a band of band_rows rows at a time. init_cur reads each band
+ * into buf, a byte grid of band_rows + 2 rows, as if it were the whole
+ * of this processor's rows, and it is packed from there, so the board
+ * is never held a byte per cell. Every processor reads as many bands
+ * as the one with the most. ASCII files, which init_cur reads from the
+ * start each time, and the patterns made without an input file, which
+ * fill in ghost rows too, are read in one band. */
+int
+init_packed(struct decomp *dc, int my_rank, char *input_file, int format, 
+            MPI_Offset header_bytes, int checkerboard, int verbose, 
+            int event_num[][NUM_EVENTS], int file_type, int band_rows, uint64_t *pbuf)
+{
+   struct decomp band = *dc;
+   size_t wpr = packed_row_words(dc->lc);
+   int stride = checkerboard ? dc->lc + 2 : dc->lc;
+   unsigned char *buf;
+   int my_bands, num_bands, i;
+   int ret;
+
+   if (!strlen(input_file) || format == PGM_ASCII)
+      band_rows = dc->ln;
+   if (!(buf = calloc((size_t)(band_rows + 2) * stride, 1)))
+      return ERR_DUMB;
+   my_bands = (dc->ln + band_rows - 1) / band_rows;
+   if ((ret = MPI_Allreduce(&my_bands, &num_bands, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD)))
+      MPIERR(ret);
+   for (i = 0; i < num_bands; i++)
+   {
+      band.row0 = dc->row0 + i * band_rows;
+      band.ln = i < my_bands ? dc->ln - i * band_rows : 0;
+      if (band.ln > band_rows)
+         band.ln = band_rows;
+      if ((ret = init_cur(&band, my_rank, 1, buf, input_file, format, header_bytes, 
+                          checkerboard, verbose, event_num, file_type)))
+         return ret;
+      if (!strlen(input_file))
+         pack_rows(checkerboard, dc->lc, dc->ln + 2, buf, pbuf);
+      else
+         pack_rows(checkerboard, dc->lc, band.ln, &buf[stride], 
+                   &pbuf[(size_t)(band.row0 - dc->row0 + 1) * wpr]);
+   }
+   free(buf);
+
+   return 0;
+}
+
+/* Write the bit grid pbuf to the open file fh, after header_bytes of
+ * header, as a PGM or PBM file, a band of band_rows rows at a time.
+ * Each band is unpacked into buf, which holds band_rows + 2 rows of
+ * the byte grid, and written with types made for it by
+ * create_mpi_types, as if it were the whole of this processor's rows.
+ * Every processor writes as many bands as the one with the most. */
+int
+write_packed_rows(struct decomp *dc, MPI_File fh, MPI_Offset header_bytes, int checkerboard, 
+                  int format, int band_rows, uint64_t *pbuf, unsigned char *buf)
+{
+   struct decomp band = *dc;
+   size_t wpr = packed_row_words(dc->lc);
+   MPI_Datatype filetype, memtype;
+   unsigned char *bits = NULL;
+   int my_bands, num_bands, i;
+   int ret;
+
+   if (format == PBM_RAW && 
+       !(bits = malloc((size_t)band_rows * ((dc->col0 + dc->lc - 1) / 8 - 
+                                            (dc->col0 + 7) / 8 + 1))))
+      return ERR_DUMB;
+   my_bands = (dc->ln + band_rows - 1) / band_rows;
+   if ((ret = MPI_Allreduce(&my_bands, &num_bands, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD)))
+      MPIERR(ret);
+   for (i = 0; i < num_bands; i++)
+   {
+      band.row0 = dc->row0 + i * band_rows;
+      band.ln = i < my_bands ? dc->ln - i * band_rows : 0;
+      if (band.ln > band_rows)
+         band.ln = band_rows;
+
+      /* With none of our rows left, we still join the collective
+       * write. The processors beside us, which pack_pbm talks to, have
+       * the same rows, so they are done too. */
+      if (!band.ln)
+      {
+         if ((ret = MPI_File_set_view(fh, 0, MPI_BYTE, MPI_BYTE, "native", MPI_INFO_NULL)))
+            MPIERR(ret);
+         if ((ret = MPI_File_write_all(fh, buf, 0, MPI_BYTE, MPI_STATUS_IGNORE)))
+            MPIERR(ret);
+         continue;
+      }
+
+      unpack_rows(checkerboard, dc->lc, band.ln + 2, 
+                  &pbuf[(size_t)(band.row0 - dc->row0) * wpr], buf);
+      if ((ret = create_mpi_types(&band, checkerboard, 1, format, &filetype, &memtype)))
+         return ret;
+      if (format == PBM_RAW && (ret = pack_pbm(&band, checkerboard, 1, buf, bits)))
+         return ret;
+      if ((ret = MPI_File_set_view(fh, header_bytes, MPI_BYTE, filetype, "native", 
+                                   MPI_INFO_NULL)))
+         MPIERR(ret);
+      if ((ret = MPI_File_write_all(fh, bits ? bits : buf, 1, memtype, MPI_STATUS_IGNORE)))
+         MPIERR(ret);
+      MPI_Type_free(&filetype);
+      MPI_Type_free(&memtype);
+   }
+   free(bits);
+
+   return 0;
+}
+
+/* Count the live cells in a bit grid, skipping the ghost rows and
+ * columns. */
+int
+count_packed_results(int my_rank, int count, int ln, int lc, int cols, 
+                     int event_num[][NUM_EVENTS], int verbose, uint64_t *pbuf, 
+                     int step, struct reduction *red)
+{
+   size_t wpr = packed_row_words(lc);
+   int64_t my_total;
+   int ret, i, w, c;
+
+   if (count)
+   {
+      for (my_total = 0, i = 1; i < ln + 1; i++)
+         for (w = 0; w < wpr; w++)
+            my_total += pop_count(pbuf[i * wpr + w] & interior_mask(w, lc));
+
+      if ((ret = sum_results(my_rank, my_total, step, verbose, event_num, red)))
+         return ret;
+
+      /* Print the local array, if small, one bit per cell. */
+      if (verbose && cols < 100)
+      {
+         if ((ret = MPI_Barrier(MPI_COMM_WORLD)))
+            MPIERR(ret);
+         for (i = 0, printf("%d: %d - ", my_rank, i); i < ln + 2; i++, printf("\t"))
+            for (c = 0; c < lc + 2; c++)
+               printf("%d, ", (int)((pbuf[i * wpr + c / CELLS_PER_WORD] >> (c % CELLS_PER_WORD)) & 1));
+         printf("\n");
+         if ((ret = MPI_Barrier(MPI_COMM_WORLD)))
+            MPIERR(ret);
+      }
+   }
+   return 0;
+}
+
+/* Scramble the number of a cell into a 64 bit value. The digest of a
+ * board is the sum of these for its live cells, so it is the same for
+ * any decomposition, and the processors can add up theirs. */
+uint64_t
+mix_cell(uint64_t x)
+{
+   x += 0x9e3779b97f4a7c15ULL;
+   x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+   x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+   return x ^ (x >> 31);
+}
+
+/* Add up the digest and the live cells of the local part of a byte
+ * grid. */
+void
+digest_rows(struct decomp *dc, int checkerboard, int ghost, unsigned char *buf, 
+            uint64_t *local)
+{
+   int stride = checkerboard ? dc->lc + 2 * ghost : dc->lc;
+   int cg = checkerboard ? ghost : 0;
+   unsigned char *row;
+   int i, j;
+
+   local[0] = local[1] = 0;
+   for (i = 0; i < dc->ln; i++)
+   {
+      row = &buf[(size_t)(ghost + i) * stride + cg];
+      for (j = 0; j < dc->lc; j++)
+         if (row[j])
+         {
+            local[0] += mix_cell((uint64_t)(dc->row0 + i) * dc->cols + dc->col0 + j);
+            local[1]++;
+         }
+   }
+}
+
+/* The same for a bit grid, one set bit at a time. */
+void
+digest_packed(struct decomp *dc, uint64_t *pbuf, uint64_t *local)
+{
+   size_t wpr = packed_row_words(dc->lc);
+   uint64_t bits;
+   int i, w, c;
+
+   local[0] = local[1] = 0;
+   for (i = 0; i < dc->ln; i++)
+      for (w = 0; w < wpr; w++)
+         for (bits = pbuf[(i + 1) * wpr + w] & interior_mask(w, dc->lc); bits; 
+              bits &= bits - 1)
+         {
+            c = w * CELLS_PER_WORD + __builtin_ctzll(bits) - 1;
+            local[0] += mix_cell((uint64_t)(dc->row0 + i) * dc->cols + dc->col0 + c);
+            local[1]++;
+         }
+}
+
+/* Keep the digests and totals of the last max + 1 generations. */
+int
+init_cycles(int max, struct cycles *cyc)
+{
+   cyc->max = max;
+   cyc->n = cyc->newest = 0;
+   if (!(cyc->digest = calloc(max + 1, sizeof(uint64_t))) || 
+       !(cyc->total = calloc(max + 1, sizeof(int64_t))))
+      return ERR_DUMB;
+
+   return 0;
+}
+
+/* Add the next board to the history, and see if it is the same as
+ * one of the last max boards. If it is, period gets how many steps ago
+ * that was, otherwise 0. Boards are taken to be the same if their
+ * digests and totals are. */
+int
+find_cycle(uint64_t *local, struct cycles *cyc, int *period)
+{
+   uint64_t global[2];
+   int h = cyc->max + 1;
+   int k, ret;
+
+   if ((ret = MPI_Allreduce(local, global, 2, MPI_UINT64_T, MPI_SUM, MPI_COMM_WORLD)))
+      MPIERR(ret);
+   cyc->newest = (cyc->newest + 1) % h;
+   cyc->digest[cyc->newest] = global[0];
+   cyc->total[cyc->newest] = (int64_t)global[1];
+   if (cyc->n < h)
+      cyc->n++;
+
+   for (*period = 0, k = 1; k < cyc->n && !*period; k++)
+      if (cyc->digest[(cyc->newest - k + h) % h] == global[0] && 
+          cyc->total[(cyc->newest - k + h) % h] == (int64_t)global[1])
+         *period = k;
+
+   return 0;
+}
+
+/* The board after step is the same as period steps before, so it will
+ * keep coming round, and we can skip as many whole periods as are
+ * left, and still be ghost steps from the last exchange of deep ghost
+ * zones. The totals of the steps skipped are printed from the history,
+ * as if they had been computed. The board after last is the one we
+ * have, so a checkpoint due in the steps skipped is written once, for
+ * last, by the caller. last gets the step to carry on after. */
+int
+skip_cycle(int my_rank, int step, int period, int num_steps, int ghost, int count, 
+           int verbose, int event_num[][NUM_EVENTS], struct cycles *cyc, 
+           struct reduction *red, int *last)
+{
+   int h = cyc->max + 1;
+   int jump, a, b, t, u, ret;
+
+   for (a = period, b = ghost; b; t = a % b, a = b, b = t)
+      ;
+   jump = period / a * ghost;
+   *last = step + (num_steps - 1 - step) / jump * jump;
+   if (*last == step)
+      return 0;
+
+   /* The last real total goes out first. */
+   if ((ret = finish_results(my_rank, event_num, red)))
+      return ret;
+   if (!my_rank && verbose)
+      printf("cycle of period %d after step %d, skipping to step %d\n", period, step, *last);
+   for (t = step + 1; t <= *last; t++)
+      if (count && !((t + 1) % count) && !my_rank)
+      {
+         /* Step t looks like step u, one of the last period steps. */
+         u = step - period + 1 + (t - step - 1) % period;
+         printf("after step: %d total: %lld\n", t, 
+                (long long)cyc->total[(cyc->newest - (step - u) + h) % h]);
+      }
+
+   /* The history starts again from the board we have. */
+   cyc->n = 1;
+
+   return 0;
+}
+
+/* Copy local column c of a bit grid, all ln + 2 rows of it, into a
+ * packed column buffer, or back out of one. */
+void
+get_packed_col(int ln, size_t wpr, int c, uint64_t *pbuf, uint64_t *col)
+{
+   int i;
+
+   memset(col, 0, packed_row_words(ln) * sizeof(uint64_t));
+   for (i = 0; i < ln + 2; i++)
+      if ((pbuf[i * wpr + c / CELLS_PER_WORD] >> (c % CELLS_PER_WORD)) & 1)
+         col[i / CELLS_PER_WORD] |= (uint64_t)1 << (i % CELLS_PER_WORD);
+}
+
+void
+put_packed_col(int ln, size_t wpr, int c, uint64_t *col, uint64_t *pbuf)
+{
+   uint64_t bit = (uint64_t)1 << (c % CELLS_PER_WORD);
+   int i;
+
+   for (i = 0; i < ln + 2; i++)
+      if ((col[i / CELLS_PER_WORD] >> (i % CELLS_PER_WORD)) & 1)
+         pbuf[i * wpr + c / CELLS_PER_WORD] |= bit;
+      else
+         pbuf[i * wpr + c / CELLS_PER_WORD] &= ~bit;
+}
+
+/* Fill the ghost rows (and columns) of a bit grid. This follows
+ * update_processes, except that whole packed rows are sent, and
+ * columns are first gathered into packed column buffers, since a
+ * column of bits can't be described with an MPI type. */
+int
+update_packed_processes(struct decomp *dc, int my_rank, int p, int checkerboard, 
+                        int verbose, int event_num[][NUM_EVENTS], 
+                        uint64_t *pcur)
+{
+   int ln = dc->ln, lc = dc->lc;
+   size_t wpr = packed_row_words(lc);
+   int ret;
+
+   phase_start(UPDATE);
+#ifdef LOGGING
+   if ((ret = MPE_Log_event(event_num[START][UPDATE], 0, "start update")))
+      MPIERR(ret);
+#endif
+
+   if (verbose && ! my_rank)
+      printf("starting packed update\n");
+
+   if (p > 1)
+   {
+      MPI_Request req[4];
+      int nreq = 0;
+
+      /* Send top and bottom rows, receive them as ghost rows. The
+       * ghost columns of these rows are overwritten by the column
+       * exchange below, or are zero at the edge of the board. */
+      if ((ret = MPI_Isend(&pcur[wpr], wpr, MPI_UINT64_T, dc->up, 0, dc->comm, &req[nreq++])))
+         MPIERR(ret);
+      if ((ret = MPI_Irecv(&pcur[(ln + 1) * wpr], wpr, MPI_UINT64_T, dc->down, 0, dc->comm, 
+                           &req[nreq++])))
+         MPIERR(ret);
+      if ((ret = MPI_Isend(&pcur[ln * wpr], wpr, MPI_UINT64_T, dc->down, 0, dc->comm, &req[nreq++])))
+         MPIERR(ret);
+      if ((ret = MPI_Irecv(&pcur[0], wpr, MPI_UINT64_T, dc->up, 0, dc->comm, &req[nreq++])))
+         MPIERR(ret);
+
+      /* All row sends must complete before col sends, because of the
+       * corners. */
+      if ((ret = MPI_Waitall(nreq, req, MPI_STATUSES_IGNORE)))
+         MPIERR(ret);
+
+      if (checkerboard)
+      {
+         int cw = packed_row_words(ln);
+         uint64_t *cols;
+
+         /* Four column buffers: send left, send right, receive left,
+          * receive right. */
+         if (!(cols = calloc(4 * cw, sizeof(uint64_t))))
+            return ERR_DUMB;
+         get_packed_col(ln, wpr, 1, pcur, &cols[0]);
+         get_packed_col(ln, wpr, lc, pcur, &cols[cw]);
+
+         nreq = 0;
+         if ((ret = MPI_Isend(&cols[0], cw, MPI_UINT64_T, dc->left, 0, dc->comm, &req[nreq++])))
+            MPIERR(ret);
+         if ((ret = MPI_Irecv(&cols[3 * cw], cw, MPI_UINT64_T, dc->right, 0, dc->comm, &req[nreq++])))
+            MPIERR(ret);
+         if ((ret = MPI_Isend(&cols[cw], cw, MPI_UINT64_T, dc->right, 0, dc->comm, &req[nreq++])))
+            MPIERR(ret);
+         if ((ret = MPI_Irecv(&cols[2 * cw], cw, MPI_UINT64_T, dc->left, 0, dc->comm, &req[nreq++])))
+            MPIERR(ret);
+         if ((ret = MPI_Waitall(nreq, req, MPI_STATUSES_IGNORE)))
+            MPIERR(ret);
+
+         if (dc->left != MPI_PROC_NULL)
+            put_packed_col(ln, wpr, 0, &cols[2 * cw], pcur);
+         if (dc->right != MPI_PROC_NULL)
+            put_packed_col(ln, wpr, lc + 1, &cols[3 * cw], pcur);
+         free(cols);
+      }
+   }
+
+   phase_end(UPDATE);
+#ifdef LOGGING
+   if ((ret = MPE_Log_event(event_num[END][UPDATE], 0, "end update")))
+      MPIERR(ret);
+#endif
+
+   return 0;
+}
+
+/* Advance a bit grid by one step. Each word of next is computed at
+ * once: the eight neighbor bit planes are added with full adders into
+ * a three bit count (eight neighbors wraps to zero, which is dead
+ * anyway), and a cell lives if the count is three, or two and the
+ * cell is already alive. For other rules, the count gets a fourth bit,
+ * for eight, and the cells with each count in the rule are picked
+ * out. */
+int 
+calculate_packed_step(int ln, int width, int event_num[][NUM_EVENTS],
+                      uint64_t *pcur, uint64_t *pnext)
+{
+   size_t wpr = packed_row_words(width);
+   uint64_t *up, *mid, *down, *out;
+   uint64_t a, aw, ae, b, bw, be, c, cw, ce;
+   uint64_t s1, c1, s2, c2, s3, c3, b0, k1, t0, t1, b1, b2, b3, t, n;
+   int conway = conway_rule();
+   int i, w, k;
+#ifdef LOGGING
+   int ret;
+#endif
 
-   if (verbose && ! my_rank)
-      printf("starting update\n");
-   
-   /* Fill the ghost rows. */
-   if (p > 1)
+   phase_start(CALCULATE);
+#ifdef LOGGING
+   if ((ret = MPE_Log_event(event_num[START][CALCULATE], 0, "start calculate")))
+      MPIERR(ret);
+#endif
+
+   for (i = 1; i < ln + 1; i++)
    {
-      if (checkerboard)
+      up = &pcur[(i - 1) * wpr];
+      mid = &pcur[i * wpr];
+      down = &pcur[(i + 1) * wpr];
+      out = &pnext[i * wpr];
+      for (w = 0; w < wpr; w++)
       {
-         MPI_Request srt, srb, rrt, rrb;
-         MPI_Request scl, rcr, rcl, scr;
+         /* The neighbors to the west are one bit up, to the east one
+          * bit down, borrowing a bit from the adjacent word. */
+         a = up[w];
+         aw = (a << 1) | (w ? up[w - 1] >> 63 : 0);
+         ae = (a >> 1) | (w < wpr - 1 ? up[w + 1] << 63 : 0);
+         b = mid[w];
+         bw = (b << 1) | (w ? mid[w - 1] >> 63 : 0);
+         be = (b >> 1) | (w < wpr - 1 ? mid[w + 1] << 63 : 0);
+         c = down[w];
+         cw = (c << 1) | (w ? down[w - 1] >> 63 : 0);
+         ce = (c >> 1) | (w < wpr - 1 ? down[w + 1] << 63 : 0);
 
-         /* On verbose runs, barrier here to make text output look nicer. */
-         if (verbose)
-            MPI_Barrier(MPI_COMM_WORLD);
+         /* Three full adders and a half adder give the ones... */
+         t = aw ^ a; s1 = t ^ ae; c1 = (aw & a) | (t & ae);
+         t = bw ^ be; s2 = t ^ cw; c2 = (bw & be) | (t & cw);
+         s3 = c ^ ce; c3 = c & ce;
+         t = s1 ^ s2; b0 = t ^ s3; k1 = (s1 & s2) | (t & s3);
 
-         /* Send top row. */
-         if (my_rank/sqrtn)
-            if ((ret = MPI_Isend(&cur[ln + 3], ln, MPI_BYTE, my_rank - sqrtn, 
-            0, MPI_COMM_WORLD, &srt)))
-               MPIERR(ret);
+         /* ...then the twos and fours. */
+         t = c1 ^ c2; t0 = t ^ c3; t1 = (c1 & c2) | (t & c3);
+         b1 = t0 ^ k1;
+         b2 = t1 ^ (t0 & k1);
 
-         /* Recieve it as bottom row. */
-         if (my_rank/sqrtn != sqrtn - 1)
-            if ((ret = MPI_Irecv(&cur[(ln + 2) * (ln + 1) + 1], ln, MPI_BYTE, my_rank + sqrtn, 
-            0, MPI_COMM_WORLD, &rrb)))
-               MPIERR(ret);
-                  
+         if (conway)
+            out[w] = b1 & ~b2 & (b0 | b) & interior_mask(w, width);
+         else
+         {
+            b3 = t1 & t0 & k1;
+            for (out[w] = 0, k = 0; k <= MAX_NEIGHBORS; k++)
+               if ((rule.birth | rule.survive) & (1 << k))
+               {
+                  n = (k & 1 ? b0 : ~b0) & (k & 2 ? b1 : ~b1) & (k & 4 ? b2 : ~b2) & 
+                     (k & 8 ? b3 : ~b3);
+                  out[w] |= n & ((rule.birth & (1 << k) ? ~b : 0) | 
+                                 (rule.survive & (1 << k) ? b : 0));
+               }
+            out[w] &= interior_mask(w, width);
+         }
+      } /* next w */
+   } /* next i */
 
-         /* Send bottom row. */
-         if (my_rank/sqrtn != sqrtn - 1)
-            if ((ret = MPI_Isend(&cur[(ln + 2) * ln + 1], ln, MPI_BYTE, my_rank + sqrtn, 
-            0, MPI_COMM_WORLD, &srb)))
-               MPIERR(ret);
+   phase_end(CALCULATE);
+#ifdef LOGGING
+   if ((ret = MPE_Log_event(event_num[END][CALCULATE], 0, "end calculate")))
+      MPIERR(ret);
+#endif
 
-         /* Recieve it as top row. */
-         if (my_rank/sqrtn)
-            if ((ret = MPI_Irecv(&cur[1], ln, MPI_BYTE, my_rank - sqrtn, 
-            0, MPI_COMM_WORLD, &rrt)))
-               MPIERR(ret);
+   return 0;
+}
 
-         /* All row sends must complete before col sends, because
-          * of the corners. */
-         if (my_rank/sqrtn)
-            if ((ret = MPI_Wait(&srt, MPI_STATUS_IGNORE)))
-               MPIERR(ret);
-         if (my_rank/sqrtn != sqrtn - 1)
-            if ((ret = MPI_Wait(&srb, MPI_STATUS_IGNORE)))
-               MPIERR(ret);
-         if (my_rank/sqrtn)
-            if ((ret = MPI_Wait(&rrt, MPI_STATUS_IGNORE)))
-               MPIERR(ret);
-         if (my_rank/sqrtn != sqrtn - 1)
-            if ((ret = MPI_Wait(&rrb, MPI_STATUS_IGNORE)))
-               MPIERR(ret);
+/* Move on to the next generation of a bit grid. The kernel writes
+ * every word of the real rows, so only the ghost rows of the new next
+ * grid need to be cleared. */
+int
+swap_packed_buffers(int ln, int width, int event_num[][NUM_EVENTS], 
+                    uint64_t **pcur, uint64_t **pnext)
+{
+   size_t wpr = packed_row_words(width);
+   uint64_t *temp;
+#ifdef LOGGING
+   int ret;
+#endif
 
-/*          MPI_Barrier(MPI_COMM_WORLD); */
+   phase_start(SWAP);
+#ifdef LOGGING
+   if ((ret = MPE_Log_event(event_num[START][SWAP], 0, "start swap")))
+      MPIERR(ret);
+#endif
 
-         /* Send left col. */
-         if (my_rank % sqrtn)
-            if ((ret = MPI_Isend(&cur[1], 1, col_type, my_rank - 1, 0, MPI_COMM_WORLD, &scl)))
-               MPIERR(ret);
+   temp = *pcur;
+   *pcur = *pnext;
+   *pnext = temp;
 
-         /* Recieve it as right col. */
-         if (((my_rank + 1) % sqrtn))
-            if ((ret = MPI_Irecv(&cur[ln + 1], 1, col_type, my_rank + 1, 0, MPI_COMM_WORLD, &rcr)))
-               MPIERR(ret);
+   memset(*pnext, 0, wpr * sizeof(uint64_t));
+   memset(&(*pnext)[(ln + 1) * wpr], 0, wpr * sizeof(uint64_t));
 
-         /* Send right col. */
-         if (((my_rank + 1) % sqrtn))
-            if ((ret = MPI_Isend(&cur[ln], 1, col_type, my_rank + 1, 0, MPI_COMM_WORLD, &scr)))
-               MPIERR(ret);
+   phase_end(SWAP);
+#ifdef LOGGING
+   if ((ret = MPE_Log_event(event_num[END][SWAP], 0, "end swap")))
+      MPIERR(ret);
+#endif
 
-         /* Recieve it as left col. */
-         if (my_rank % sqrtn)
-            if ((ret = MPI_Irecv(&cur[0], 1, col_type, my_rank - 1, 0, MPI_COMM_WORLD, &rcl)))
-               MPIERR(ret);
+   return 0;
+}
 
-         /* All row sends must complete before we calculate. */
-         if (my_rank % sqrtn)
-            if ((ret = MPI_Wait(&scl, MPI_STATUS_IGNORE)))
-               MPIERR(ret);
-         if (((my_rank + 1) % sqrtn))
-            if ((ret = MPI_Wait(&rcr, MPI_STATUS_IGNORE)))
-               MPIERR(ret);
-         if (((my_rank + 1) % sqrtn))
-            if ((ret = MPI_Wait(&scr, MPI_STATUS_IGNORE)))
-               MPIERR(ret);
-         if (my_rank % sqrtn)
-            if ((ret = MPI_Wait(&rcl, MPI_STATUS_IGNORE)))
-               MPIERR(ret);
+/* Find the node with these four children in the hash table, or make
+ * it. Nodes are never changed once made, so equal squares of the board
+ * are always the same node, and a result worked out for one of them
+ * holds for all. When memory runs out this returns NULL, and so does
+ * every function which makes nodes, given a NULL node, so the NULL
+ * finds its way back to hash_step. */
+struct hnode *
+hash_node(struct hashlife *hl, struct hnode *nw, struct hnode *ne, struct hnode *sw, 
+          struct hnode *se)
+{
+   struct hnode *node, *made, *next, **table;
+   struct hblock *block;
+   uint64_t h;
+   int b, i;
+
+   if (!nw || !ne || !sw || !se)
+      return NULL;
+   h = (uint64_t)(uintptr_t)nw;
+   h = h * HASH_MULT + (uintptr_t)ne;
+   h = h * HASH_MULT + (uintptr_t)sw;
+   h = h * HASH_MULT + (uintptr_t)se;
+   h ^= h >> 29;
+   b = (int)(h & (hl->nbuckets - 1));
+
+   for (node = hl->table[b]; node; node = node->chain)
+      if (node->nw == nw && node->ne == ne && node->sw == sw && node->se == se)
+         return node;
+
+   /* Get a node from the current block, or a new block. */
+   if (!hl->blocks || hl->used == HASH_BLOCK_NODES)
+   {
+      if (!(block = malloc(sizeof(struct hblock))))
+         return NULL;
+      block->next = hl->blocks;
+      hl->blocks = block;
+      hl->used = 0;
+   }
+   node = &hl->blocks->nodes[hl->used++];
+   node->nw = nw;
+   node->ne = ne;
+   node->sw = sw;
+   node->se = se;
+   node->level = nw->level + 1;
+   node->pop = nw->pop + ne->pop + sw->pop + se->pop;
+   node->result = NULL;
+   node->result_log = -1;
+   node->chain = hl->table[b];
+   hl->table[b] = node;
+   made = node;
+
+   /* Double the table when the chains get long. */
+   if (++hl->nnodes > hl->nbuckets)
+   {
+      if (!(table = calloc(2 * hl->nbuckets, sizeof(struct hnode *))))
+         return made;
+      for (i = 0; i < hl->nbuckets; i++)
+         for (node = hl->table[i]; node; node = next)
+         {
+            next = node->chain;
+            h = (uint64_t)(uintptr_t)node->nw;
+            h = h * HASH_MULT + (uintptr_t)node->ne;
+            h = h * HASH_MULT + (uintptr_t)node->sw;
+            h = h * HASH_MULT + (uintptr_t)node->se;
+            h ^= h >> 29;
+            b = (int)(h & (2 * hl->nbuckets - 1));
+            node->chain = table[b];
+            table[b] = node;
+         }
+      free(hl->table);
+      hl->table = table;
+      hl->nbuckets *= 2;
+   }
+
+   return made;
+}
+
+/* Return the node of the given level which is all wall. */
+struct hnode *
+wall_node(struct hashlife *hl, int level)
+{
+   if (!hl->walls[level])
+   {
+      struct hnode *w = wall_node(hl, level - 1);
+      hl->walls[level] = hash_node(hl, w, w, w, w);
+   }
+   return hl->walls[level];
+}
+
+/* Return the middle half of a node, one level down. */
+struct hnode *
+hash_centre(struct hashlife *hl, struct hnode *n)
+{
+   if (!n)
+      return NULL;
+   return hash_node(hl, n->nw->se, n->ne->sw, n->sw->ne, n->se->nw);
+}
+
+/* Return a node one level up, with n in the middle and wall all
+ * around it. */
+struct hnode *
+hash_pad(struct hashlife *hl, struct hnode *n)
+{
+   struct hnode *w;
+
+   if (!n)
+      return NULL;
+   w = wall_node(hl, n->level - 1);
+   return hash_node(hl, hash_node(hl, w, w, w, n->nw), hash_node(hl, w, w, n->ne, w),
+                    hash_node(hl, w, n->sw, w, w), hash_node(hl, n->se, w, w, w));
+}
+
+/* The life rule for one cell of the Hashlife engine. Walls never
+ * change, and count as dead neighbors. */
+struct hnode *
+hash_rule(struct hashlife *hl, struct hnode *cell, int neighbors)
+{
+   if (cell->state == HCELL_WALL)
+      return cell;
+   return &hl->cells[rule.table[cell->state == HCELL_LIVE][neighbors] ? HCELL_LIVE : HCELL_DEAD];
+}
+
+/* Work out the middle 2x2 of a 4x4 node one generation on, the hard
+ * way. */
+struct hnode *
+hash_base(struct hashlife *hl, struct hnode *n)
+{
+   struct hnode *c[4][4], *r[2][2];
+   struct hnode *q[2][2] = {{n->nw, n->ne}, {n->sw, n->se}};
+   int i, j, di, dj, neighbors;
+
+   for (i = 0; i < 2; i++)
+      for (j = 0; j < 2; j++)
+      {
+         c[2 * i][2 * j] = q[i][j]->nw;
+         c[2 * i][2 * j + 1] = q[i][j]->ne;
+         c[2 * i + 1][2 * j] = q[i][j]->sw;
+         c[2 * i + 1][2 * j + 1] = q[i][j]->se;
       }
-      else
+
+   for (i = 1; i < 3; i++)
+      for (j = 1; j < 3; j++)
       {
-         MPI_Request srt, rrt, srb, rrb;
+         for (neighbors = 0, di = -1; di <= 1; di++)
+            for (dj = -1; dj <= 1; dj++)
+               if ((di || dj) && c[i + di][j + dj]->state == HCELL_LIVE)
+                  neighbors++;
+         r[i - 1][j - 1] = hash_rule(hl, c[i][j], neighbors);
+      }
 
-         /* Send top row. */
-         if (my_rank != 0)
-            if ((ret = MPI_Isend(&cur[size], size, MPI_BYTE, my_rank-1, 0, MPI_COMM_WORLD, &srt)))
-               MPIERR(ret);
+   return hash_node(hl, r[0][0], r[0][1], r[1][0], r[1][1]);
+}
 
-         if (my_rank != p - 1)
-            if ((ret = MPI_Irecv(&cur[(ln + 1) * size], size, MPI_BYTE, my_rank+1, 0, MPI_COMM_WORLD, 
-            &rrt)))
-               MPIERR(ret);
+/* Return the middle half of node n, 2^j generations on, where j is no
+ * more than the level of n less two. This is the heart of Hashlife:
+ * the node is cut into nine overlapping squares of half its size,
+ * these are advanced (or, for a smaller j, just trimmed), put together
+ * again as four squares, and those are advanced. Each node remembers
+ * its last result, so repeated squares of the board cost nothing. */
+struct hnode *
+hash_advance(struct hashlife *hl, struct hnode *n, int j)
+{
+   struct hnode *nw, *ne, *sw, *se;
+   struct hnode *t[3][3];
+   int k, a, b, jj;
 
-         /* Send bottom row. */
-         if (my_rank != p - 1)
-            if ((ret = MPI_Isend(&cur[ln * size], size, MPI_BYTE, my_rank+1, 0, MPI_COMM_WORLD, &srb)))
-               MPIERR(ret);
+   if (!n)
+      return NULL;
+   nw = n->nw;
+   ne = n->ne;
+   sw = n->sw;
+   se = n->se;
+   k = n->level;
 
-         if (my_rank != 0)
-            if ((ret = MPI_Irecv(&cur[0], size, MPI_BYTE, my_rank-1, 0, MPI_COMM_WORLD, &rrb)))
-               MPIERR(ret);
+   /* With nothing alive, nothing changes. */
+   if (!n->pop)
+      return hash_centre(hl, n);
+   if (n->result && n->result_log == j)
+      return n->result;
 
-         /* All row sends must complete before we calculate. */
-         if (my_rank != 0)
-            if ((ret = MPI_Wait(&srt, MPI_STATUS_IGNORE)))
-               MPIERR(ret);
-         if (my_rank != p - 1)
-            if ((ret = MPI_Wait(&rrt, MPI_STATUS_IGNORE)))
-               MPIERR(ret);
-         if (my_rank != p - 1)
-            if ((ret = MPI_Wait(&srb, MPI_STATUS_IGNORE)))
-               MPIERR(ret);
-         if (my_rank != 0)
-            if ((ret = MPI_Wait(&rrb, MPI_STATUS_IGNORE)))
-               MPIERR(ret);
-      }
+   if (k == 2)
+      n->result = hash_base(hl, n);
+   else
+   {
+      t[0][0] = nw;
+      t[0][1] = hash_node(hl, nw->ne, ne->nw, nw->se, ne->sw);
+      t[0][2] = ne;
+      t[1][0] = hash_node(hl, nw->sw, nw->se, sw->nw, sw->ne);
+      t[1][1] = hash_node(hl, nw->se, ne->sw, sw->ne, se->nw);
+      t[1][2] = hash_node(hl, ne->sw, ne->se, se->nw, se->ne);
+      t[2][0] = sw;
+      t[2][1] = hash_node(hl, sw->ne, se->nw, sw->se, se->sw);
+      t[2][2] = se;
+
+      /* Going full speed, each half of the time is done by a level
+       * down; otherwise all the time is done by the second half. */
+      jj = j == k - 2 ? k - 3 : j;
+      for (a = 0; a < 3; a++)
+         for (b = 0; b < 3; b++)
+            t[a][b] = j == k - 2 ? hash_advance(hl, t[a][b], jj) : hash_centre(hl, t[a][b]);
+
+      n->result = hash_node(hl, 
+                            hash_advance(hl, hash_node(hl, t[0][0], t[0][1], t[1][0], t[1][1]), jj),
+                            hash_advance(hl, hash_node(hl, t[0][1], t[0][2], t[1][1], t[1][2]), jj),
+                            hash_advance(hl, hash_node(hl, t[1][0], t[1][1], t[2][0], t[2][1]), jj),
+                            hash_advance(hl, hash_node(hl, t[1][1], t[1][2], t[2][1], t[2][2]), jj));
    }
+   n->result_log = j;
 
-#ifdef LOGGING
-   if ((ret = MPE_Log_event(event_num[END][UPDATE], 0, "end update")))
-      MPIERR(ret);
-#endif
+   return n->result;
+}
+
+/* Build the node of the given level whose top left corner is at row
+ * r0, column c0 of the board. buf is a byte grid with rows stride long,
+ * pointing at the first real cell. */
+struct hnode *
+hash_build(struct hashlife *hl, int level, int r0, int c0, unsigned char *buf, int stride)
+{
+   int half = 1 << (level - 1);
+
+   if (r0 >= hl->rows || c0 >= hl->cols)
+      return wall_node(hl, level);
+   if (!level)
+      return &hl->cells[buf[(size_t)r0 * stride + c0] ? HCELL_LIVE : HCELL_DEAD];
+   return hash_node(hl, hash_build(hl, level - 1, r0, c0, buf, stride), 
+                    hash_build(hl, level - 1, r0, c0 + half, buf, stride), 
+                    hash_build(hl, level - 1, r0 + half, c0, buf, stride), 
+                    hash_build(hl, level - 1, r0 + half, c0 + half, buf, stride));
+}
+
+/* Copy the live cells of node n, with its top left corner at row r0,
+ * column c0 of the board, into a byte grid which has been zeroed. */
+void
+hash_unpack(struct hashlife *hl, struct hnode *n, int r0, int c0, unsigned char *buf, 
+            int stride)
+{
+   int half;
+
+   if (!n->pop || r0 >= hl->rows || c0 >= hl->cols)
+      return;
+   if (!n->level)
+   {
+      buf[(size_t)r0 * stride + c0] = 255;
+      return;
+   }
+   half = 1 << (n->level - 1);
+   hash_unpack(hl, n->nw, r0, c0, buf, stride);
+   hash_unpack(hl, n->ne, r0, c0 + half, buf, stride);
+   hash_unpack(hl, n->sw, r0 + half, c0, buf, stride);
+   hash_unpack(hl, n->se, r0 + half, c0 + half, buf, stride);
+}
+
+/* Throw away every node. */
+void
+hash_free_nodes(struct hashlife *hl)
+{
+   struct hblock *block;
+
+   while ((block = hl->blocks))
+   {
+      hl->blocks = block->next;
+      free(block);
+   }
+   memset(hl->table, 0, hl->nbuckets * sizeof(struct hnode *));
+   memset(hl->walls, 0, sizeof(hl->walls));
+   hl->walls[0] = &hl->cells[HCELL_WALL];
+   hl->nnodes = 0;
+   hl->used = 0;
+}
+
+/* Set up the Hashlife engine with the board in a byte grid (as filled
+ * by init_cur, for a single processor). The board sits in the top left
+ * of the smallest square node that holds it, and the rest is wall. */
+int
+init_hashlife(int rows, int cols, unsigned char *buf, int stride, struct hashlife *hl)
+{
+   int i;
+
+   hl->rows = rows;
+   hl->cols = cols;
+   for (hl->level = 2; (1 << hl->level) < rows || (1 << hl->level) < cols; hl->level++)
+      ;
+   for (i = 0; i < 3; i++)
+   {
+      memset(&hl->cells[i], 0, sizeof(struct hnode));
+      hl->cells[i].state = i;
+      hl->cells[i].pop = i == HCELL_LIVE;
+   }
+   hl->nbuckets = HASH_BUCKETS;
+   hl->blocks = NULL;
+   if (!(hl->table = calloc(hl->nbuckets, sizeof(struct hnode *))))
+      return ERR_DUMB;
+   hash_free_nodes(hl);
+   if (!(hl->root = hash_build(hl, hl->level, 0, 0, buf, stride)))
+      return ERR_DUMB;
 
    return 0;
 }
 
-/* Advance the game of life by one step by looking at the cur array
- * and filling the next array with the values for the next
- * generation. */
-int 
-calculate_next_step(int checkerboard, int ln, int size, int event_num[][NUM_EVENTS],
-                    unsigned char *cur, unsigned char *next)
+/* Advance the Hashlife board by gens generations, one power of two at
+ * a time. For 2^j generations the board is padded with wall until it
+ * is the middle of a node of level j + 2 or more, and after the jump
+ * the padding is trimmed off again. When there are too many nodes, the
+ * board is copied out and everything else is thrown away. */
+int
+hash_step(struct hashlife *hl, int gens, int event_num[][NUM_EVENTS])
 {
-   int neighbors;
-   int i, j;
+   struct hnode *n;
+   unsigned char *buf;
+   int j;
 #ifdef LOGGING
    int ret;
 #endif
 
+   phase_start(CALCULATE);
 #ifdef LOGGING
    if ((ret = MPE_Log_event(event_num[START][CALCULATE], 0, "start calculate")))
       MPIERR(ret);
 #endif
 
-   if (checkerboard)
-   {
-      /* Skip first and last row and col, the ghost data. */
-      for (i = 1; i < ln + 1; i++)
+   for (j = 30; j >= 0; j--)
+      if (gens & (1 << j))
       {
-         for (j = 1; j < ln + 1; j++)
-         {
-            /* Count neighbors. */
-            neighbors = 0;
-            if (cur[(i-1) * (ln + 2) + j-1]) neighbors++;
-            if (cur[(i-1) * (ln + 2) + j]) neighbors++;
-            if (cur[(i-1) * (ln + 2) + j+1]) neighbors++;
+         for (n = hash_pad(hl, hl->root); n && n->level < j + 2; n = hash_pad(hl, n))
+            ;
+         for (n = hash_advance(hl, n, j); n && n->level > hl->level; n = hash_centre(hl, n))
+            ;
+         if (!n)
+            return ERR_DUMB;
+         hl->root = n;
+      }
+
+   if (hl->nnodes > HASH_MAX_NODES)
+   {
+      if (!(buf = calloc((size_t)hl->rows * hl->cols, 1)))
+         return ERR_DUMB;
+      hash_unpack(hl, hl->root, 0, 0, buf, hl->cols);
+      hash_free_nodes(hl);
+      hl->root = hash_build(hl, hl->level, 0, 0, buf, hl->cols);
+      free(buf);
+      if (!hl->root)
+         return ERR_DUMB;
+   }
 
-            if (cur[i * (ln + 2) + j-1]) neighbors++;
-            if (cur[i * (ln + 2) + j+1]) neighbors++;
+   phase_end(CALCULATE);
+#ifdef LOGGING
+   if ((ret = MPE_Log_event(event_num[END][CALCULATE], 0, "end calculate")))
+      MPIERR(ret);
+#endif
 
-            if (cur[(i+1) * (ln + 2) + j-1]) neighbors++;
-            if (cur[(i+1) * (ln + 2) + j]) neighbors++;
-            if (cur[(i+1) * (ln + 2) + j+1]) neighbors++;
+   return 0;
+}
 
-            /* Check for change. */
-            if (cur[i * (ln + 2) + j])
-               next[i * (ln + 2) + j] = (unsigned char)((neighbors > A_CROWD || neighbors < COMPANY) ? 0 : 255);
-            else
-               next[i * (ln + 2) + j] = (unsigned char)((neighbors == NUM_PARENTS) ? 255 : 0);
+/* Free everything the Hashlife engine has. */
+void
+finish_hashlife(struct hashlife *hl)
+{
+   hash_free_nodes(hl);
+   free(hl->table);
+}
 
-/*             if (verbose)
-               printf("%d: %d, %d, cur=%d, neighbors=%d next=%d\n", my_rank, i, j, cur[i * (ln + 2) + j], 
-               neighbors, next[i * size + j]);*/
-         } /* next j */
-      } /* next i */
-   }
-   else
+/* Create stream file f, a raw PGM file the size of the board, whose
+ * cells are filled in as they are computed. Processor 0 makes it, and
+ * then the others open it. */
+int
+create_stream_file(struct decomp *dc, int my_rank, struct stream *st, int f)
+{
+   char hdr[MAX_NAME + 1];
+   int ret;
+
+   sprintf(hdr, "P5\n%d %d\n255\n", dc->cols, dc->rows);
+   st->header_bytes = strlen(hdr);
+   if (!my_rank)
    {
-      for (i = 1; i < ln + 1; i++)
-      {
-         for (j = 0; j < size; j++)
-         {
-            /* Count neighbors. */
-            neighbors = 0;
-            if (j && cur[(i-1) * size + j-1]) neighbors++;
-            if (cur[(i-1) * size + j]) neighbors++;
-            if (j < size - 1 && cur[(i-1) * size + j+1]) neighbors++;
+      if ((st->fd[f] = open(st->name[f], O_RDWR | O_CREAT | O_TRUNC, 0666)) < 0 ||
+          write(st->fd[f], hdr, strlen(hdr)) != (ssize_t)strlen(hdr) ||
+          posix_fallocate(st->fd[f], 0, st->header_bytes + (off_t)dc->rows * dc->cols))
+         return ERR_FILE;
+   }
+   if ((ret = MPI_Barrier(MPI_COMM_WORLD)))
+      MPIERR(ret);
+   if (my_rank && (st->fd[f] = open(st->name[f], O_RDWR)) < 0)
+      return ERR_FILE;
+   st->given[f] = 0;
 
-            if (j && cur[i * size + j-1]) neighbors++;
-            if (j < size - 1 && cur[i * size + j+1]) neighbors++;
+   return 0;
+}
 
-            if (j && cur[(i+1) * size + j-1]) neighbors++;
-            if (cur[(i+1) * size + j]) neighbors++;
-            if (j < size - 1 && cur[(i+1) * size + j+1]) neighbors++;
+/* Map n rows of stream file f, starting with row first, all of which
+ * must be on the board. A mapping has to start on a page, so the one
+ * made is returned in map and len, for munmap, and the rows start at
+ * *rows. */
+int
+map_rows(struct stream *st, int f, int cols, int first, int n, int prot, void **map, 
+         size_t *len, unsigned char **rows)
+{
+   off_t off = st->header_bytes + (off_t)first * cols;
+   off_t start = off - off % st->page;
 
-            /* Check for change. */
-            if (cur[i * size + j])
-               next[i * size + j] = (unsigned char)((neighbors > A_CROWD || neighbors < COMPANY) ? 0 : 255);
-            else
-               next[i * size + j] = (unsigned char)((neighbors == NUM_PARENTS) ? 255 : 0);
+   *len = off - start + (size_t)n * cols;
+   if ((*map = mmap(NULL, *len, prot, MAP_SHARED, st->fd[f], start)) == MAP_FAILED)
+      return ERR_FILE;
+   *rows = (unsigned char *)*map + (off - start);
 
-/*          if (verbose)
-            printf("%d: %d, %d, cur=%d, neighbors=%d next=%d\n", my_rank, i, j, cur[i * size + j], 
-            neighbors, next[i * size + j]);*/
-         } /* next j */
-      } /* next i */
-   }
+   return 0;
+}
 
-#ifdef LOGGING
-   if ((ret = MPE_Log_event(event_num[END][CALCULATE], 0, "end calculate")))
-      MPIERR(ret);
-#endif
+/* Map level 0 of the band which starts at row a of the board: rows
+ * a - 1 to a + band_rows of the board file, or those of them which are
+ * on the board, rows first to last. If ahead is set, ask for them to
+ * be read in now, while the band before this one is computed. */
+int
+map_band(struct decomp *dc, struct stream *st, int a, int ahead, void **map, size_t *len, 
+         unsigned char **rows, int *first, int *last)
+{
+   int ret;
+
+   *first = a - 1 > 0 ? a - 1 : 0;
+   *last = a + st->band_rows + 1 < dc->rows ? a + st->band_rows + 1 : dc->rows;
+   *map = NULL;
+   if (*last <= *first)
+      return 0;
+   if ((ret = map_rows(st, st->cur, dc->cols, *first, *last - *first, PROT_READ, map, len, 
+                       rows)))
+      return ret;
+   if (ahead && madvise(*map, *len, MADV_WILLNEED))
+      return ERR_FILE;
 
    return 0;
 }
 
-/* Write the game data for the current generation to a PGM output
- * file, which can be understood by many programs - GIMP, for
- * example. */
+/* Set up the stream engine, with bands of band_rows rows and passes
+ * of up to depth generations, and copy the board from the input file
+ * into its first file, a band at a time, with the collective reads of
+ * init_cur. Every processor does as many reads as the one with the
+ * most bands. If live is not NULL, it gets the live cells of this
+ * processor's rows. */
 int
-write_output(int p, int size, int my_rank, int s, int ln, MPI_Datatype filetype, 
-             MPI_Datatype memtype, int verbose, int event_num[][NUM_EVENTS], 
-             unsigned char *cur)
+init_stream(struct decomp *dc, int my_rank, int depth, int band_rows, char *input_file, 
+            int format, MPI_Offset header_bytes, int verbose, int event_num[][NUM_EVENTS], 
+            struct stream *st, int64_t *live)
 {
-   int header_bytes;
-   MPI_File out_fh;
-   char output_file[128], hdr[128];
+   struct decomp band = *dc;
+   MPI_File fh;
+   unsigned char *pbuf = NULL, *rows;
+   void *map = NULL;
+   size_t len = 0;
+   int my_bands, num_bands, i, f, id;
    int ret;
 
+   st->depth = depth;
+   st->band_rows = band_rows;
+   st->page = sysconf(_SC_PAGESIZE);
+   st->cur = 0;
+   id = getpid();
+   if ((ret = MPI_Bcast(&id, 1, MPI_INT, 0, MPI_COMM_WORLD)))
+      MPIERR(ret);
+   for (f = 0; f < 2; f++)
+   {
+      sprintf(st->name[f], STREAM_FILE, id, f);
+      if ((ret = create_stream_file(dc, my_rank, st, f)))
+         return ret;
+   }
+   if (!(st->levels = malloc((size_t)(depth + 1) * (band_rows + 2) * dc->cols)))
+      return ERR_DUMB;
+   if (verbose && !my_rank)
+      printf("streaming through %s and %s in bands of %d rows, %d generations a pass\n", 
+             st->name[0], st->name[1], band_rows, depth);
+
+   phase_start(INGEST);
 #ifdef LOGGING
-   if ((ret = MPE_Log_event(event_num[START][WRITE], 0, "start write")))
+   if ((ret = MPE_Log_event(event_num[START][INGEST], 0, "start ingest")))
       MPIERR(ret);
 #endif
 
-   /* Delete and then create output file. */
-   sprintf(output_file, "ann/out_%d_%d.pgm", p, s);
-   if (verbose && !my_rank)
-      printf("output %s, s=%d\n", output_file, s);
-   MPI_File_delete(output_file, MPI_INFO_NULL);
-   if ((ret = MPI_File_open(MPI_COMM_WORLD, output_file, MPI_MODE_CREATE|MPI_MODE_RDWR, 
-                            MPI_INFO_NULL, &out_fh)))
+   if ((ret = MPI_File_open(MPI_COMM_WORLD, input_file, MPI_MODE_RDONLY, MPI_INFO_NULL, 
+                            &fh)))
       MPIERR(ret);
-
-   /* Create header info, and have process 0 write it to the file. */
-   sprintf(hdr, "P5\n%d %d\n255\n", size, size);
-   header_bytes = strlen(hdr);
-   if ((ret = MPI_File_write_all(out_fh, hdr, header_bytes, MPI_BYTE, MPI_STATUS_IGNORE)))
+   if (format == PBM_RAW && !(pbuf = malloc((size_t)band_rows * ((dc->cols + 7) / 8))))
+      return ERR_DUMB;
+   my_bands = (dc->ln + band_rows - 1) / band_rows;
+   if ((ret = MPI_Allreduce(&my_bands, &num_bands, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD)))
       MPIERR(ret);
-         
-   /* Set the file view to translate our memory data into the file's data layout. */
-   MPI_File_set_view(out_fh, header_bytes, MPI_BYTE, filetype, "native", MPI_INFO_NULL);
-
-   /* Write the output. */
-   MPI_File_write_all(out_fh, cur, 1, memtype, MPI_STATUS_IGNORE);
-   if ((ret = MPI_File_close(&out_fh)))
+   if (live)
+      *live = 0;
+   for (i = 0; i < num_bands; i++)
+   {
+      /* Each band is read as if it were the whole of a processor's
+       * rows, straight into the mapped file. */
+      band.row0 = dc->row0 + i * band_rows;
+      band.ln = i < my_bands ? dc->ln - i * band_rows : 0;
+      if (band.ln > band_rows)
+         band.ln = band_rows;
+      rows = st->levels;
+      if (band.ln && (ret = map_rows(st, st->cur, dc->cols, band.row0, band.ln, 
+                                     PROT_READ | PROT_WRITE, &map, &len, &rows)))
+         return ret;
+      if (format == PBM_RAW)
+         ret = read_pbm_rows(&band, fh, header_bytes, 0, 0, 0, band.ln, pbuf, rows);
+      else
+         ret = read_rows(&band, fh, header_bytes, 0, 0, 0, 0, band.ln, rows);
+      if (ret)
+         return ret;
+      if (band.ln)
+      {
+         if (live)
+            *live += count_rows(0, band.ln, dc->cols, 0, rows, 0, band.ln);
+         if (msync(map, len, MS_ASYNC) || munmap(map, len))
+            return ERR_FILE;
+      }
+   }
+   free(pbuf);
+   if ((ret = MPI_File_close(&fh)))
       MPIERR(ret);
 
+   phase_end(INGEST);
 #ifdef LOGGING
-   if ((ret = MPE_Log_event(event_num[END][WRITE], 0, "end write")))
+   if ((ret = MPE_Log_event(event_num[END][INGEST], 0, "end ingest")))
       MPIERR(ret);
 #endif
 
    return 0;
 }
 
-/* Move on to the next generation. */
+/* Advance the board in the stream files by steps generations, up to
+ * the depth of the stream, in one pass over this processor's rows.
+ * The generations are computed as a wavefront. Each band read from
+ * the file is level 0, and level k, generation k of the pass, is
+ * computed by calculate_region from the band of level k - 1 and the
+ * two rows kept from the band above, so it ends one row higher on the
+ * board than level k - 1. The first band starts steps - 1 rows above
+ * this processor's rows, which is as far as the rows above it, left
+ * dead in every level, reach by the last level. The rows of the last
+ * level which are this processor's go to the next file, and the rows
+ * above and below them, which other processors write, are only read
+ * from the file, so there is nothing to exchange; the processors just
+ * wait for each other at the end of the pass. That is only safe because
+ * every processor maps the same pages of the one page cache, so what
+ * one writes is there for the others to read once the barrier is
+ * passed; msync just starts the write back. Processors on other nodes
+ * could read stale pages, so main refuses to stream across nodes. If
+ * live is not NULL, it gets the live cells written. */
 int
-swap_buffers(int ln, int size, int checkerboard, int event_num[][NUM_EVENTS], 
-             unsigned char **cur, unsigned char **next)
+stream_pass(struct decomp *dc, int my_rank, int steps, int event_num[][NUM_EVENTS], 
+            row_kernel_t row_kernel, struct pool *pool, struct stream *st, int64_t *live)
 {
-   unsigned char *temp;
-   int i;
+   int rows = dc->rows, cols = dc->cols, b = st->band_rows;
+   int r0 = dc->row0, r1 = dc->row0 + dc->ln;
+   size_t level_size = (size_t)(b + 2) * cols;
+   unsigned char *prev, *level, *in[2], *out;
+   void *map[2], *out_map;
+   size_t len[2], out_len;
+   int first[2], last[2];
+   int next = !st->cur;
+   int a, k, m, n, top, lo, hi;
+   int ret;
+
+   /* A file which was given to an output file is made again. */
+   if (st->given[next])
+   {
+      close(st->fd[next]);
+      if ((ret = create_stream_file(dc, my_rank, st, next)))
+         return ret;
+   }
+
+   /* Level 0 is filled in from the file, and the rest are computed,
+    * except for the two rows above the first band. */
+   if (live)
+      *live = 0;
+   for (k = 1; k <= steps; k++)
+      memset(&st->levels[k * level_size], 0, 2 * (size_t)cols);
+   a = r0 - steps + 1;
+   if ((ret = map_band(dc, st, a, 0, &map[0], &len[0], &in[0], &first[0], &last[0])))
+      return ret;
+   for (m = 0; a - steps + 1 < r1; a += b, m = !m)
+   {
+      /* Map the next band, to be read in while this one is
+       * computed, and copy this one into level 0. */
+      phase_start(UPDATE);
+#ifdef LOGGING
+      if ((ret = MPE_Log_event(event_num[START][UPDATE], 0, "start update")))
+         MPIERR(ret);
+#endif
+      map[!m] = NULL;
+      if (a + b - steps + 1 < r1)
+         if ((ret = map_band(dc, st, a + b, 1, &map[!m], &len[!m], &in[!m], &first[!m], 
+                             &last[!m])))
+            return ret;
+      level = st->levels;
+      if (first[m] > a - 1 || last[m] < a + b + 1)
+         memset(level, 0, level_size);
+      if (map[m])
+      {
+         memcpy(&level[(size_t)(first[m] - a + 1) * cols], in[m], 
+                (size_t)(last[m] - first[m]) * cols);
+         if (munmap(map[m], len[m]))
+            return ERR_FILE;
+      }
+      phase_end(UPDATE);
+#ifdef LOGGING
+      if ((ret = MPE_Log_event(event_num[END][UPDATE], 0, "end update")))
+         MPIERR(ret);
+#endif
+
+      /* Level k holds rows top to top + b of the board in its rows 2
+       * to b + 2. Rows off the board stay dead. */
+      phase_start(CALCULATE);
+#ifdef LOGGING
+      if ((ret = MPE_Log_event(event_num[START][CALCULATE], 0, "start calculate")))
+         MPIERR(ret);
+#endif
+      for (k = 1; k <= steps; k++)
+      {
+         prev = level;
+         level += level_size;
+         calculate_region(0, b, cols, 1, row_kernel, pool, prev, level + cols, 1, b + 1, 
+                          0, cols, NULL);
+         top = a - k + 1;
+         if (top < 0)
+            memset(&level[2 * (size_t)cols], 0, (size_t)(-top < b ? -top : b) * cols);
+         if (top + b > rows)
+         {
+            n = top + b - rows < b ? top + b - rows : b;
+            memset(&level[(size_t)(b + 2 - n) * cols], 0, (size_t)n * cols);
+         }
+      }
+      phase_end(CALCULATE);
+#ifdef LOGGING
+      if ((ret = MPE_Log_event(event_num[END][CALCULATE], 0, "end calculate")))
+         MPIERR(ret);
+#endif
+
+      /* Copy this processor's rows of the last level into the next
+       * file, and let the kernel write them back in the background. */
+      phase_start(WRITE);
+#ifdef LOGGING
+      if ((ret = MPE_Log_event(event_num[START][WRITE], 0, "start write")))
+         MPIERR(ret);
+#endif
+      top = a - steps + 1;
+      lo = top > r0 ? top : r0;
+      hi = top + b < r1 ? top + b : r1;
+      if (hi > lo)
+      {
+         if ((ret = map_rows(st, next, cols, lo, hi - lo, PROT_READ | PROT_WRITE, &out_map, 
+                             &out_len, &out)))
+            return ret;
+         memcpy(out, &level[(size_t)(lo - top + 2) * cols], (size_t)(hi - lo) * cols);
+         if (live)
+            *live += count_rows(0, b, cols, 0, level, lo - top + 2, hi - top + 2);
+         if (msync(out_map, out_len, MS_ASYNC) || munmap(out_map, out_len))
+            return ERR_WRITE;
+      }
+      phase_end(WRITE);
 #ifdef LOGGING
-   int ret;
+      if ((ret = MPE_Log_event(event_num[END][WRITE], 0, "end write")))
+         MPIERR(ret);
 #endif
 
+      /* The last two rows of each level are the rows above the next
+       * band. */
+      for (k = 1, level = st->levels + level_size; k <= steps; k++, level += level_size)
+         memmove(level, &level[(size_t)b * cols], 2 * (size_t)cols);
+   }
+
+   /* The next file is the board once everyone has written it. */
+   phase_start(SWAP);
 #ifdef LOGGING
    if ((ret = MPE_Log_event(event_num[START][SWAP], 0, "start swap")))
       MPIERR(ret);
 #endif
-
-   /* Swap the buffers. */
-   temp = *cur;
-   *cur = *next;
-   *next = temp;
-
-   /* Reinitialize for the next generation. */
-   if (checkerboard)
-      for (i = 0; i < (ln + 2) * (ln + 2); i++)
-         (*next)[i] = 0;
-   else
-      for (i = 0; i < (ln + 2) * size; i++)
-         (*next)[i] = 0;
-
+   if ((ret = MPI_Barrier(MPI_COMM_WORLD)))
+      MPIERR(ret);
+   st->cur = next;
+   phase_end(SWAP);
 #ifdef LOGGING
-      if ((ret = MPE_Log_event(event_num[END][SWAP], 0, "end swap")))
-         MPIERR(ret);
+   if ((ret = MPE_Log_event(event_num[END][SWAP], 0, "end swap")))
+      MPIERR(ret);
 #endif
 
    return 0;
 }
 
-/* We need two grids, one for the current generation, and one for the
- * next generation. The size of the local buffers depends on the total
- * size of the playing field (size), the number of processors (n), and
- * the data decomposition method. This function determine sqrtn, ln,
- * and allocates the cur and next buffers. */   
+/* Output the board after step s by renaming the stream file which
+ * holds it to the file write_output would have written. It stays
+ * open, to be read by the next pass, and is made again before it is
+ * written to. */
 int
-init_grid(int my_rank, int n, int size, int checkerboard, int *sqrtn, int *ln, 
-          unsigned char **cur, unsigned char **next)
+stream_output(int my_rank, int p, int s, struct stream *st)
 {
-   int buf_size;
+   char output_file[MAX_NAME + 1];
 
-   /* Determine local grid size. */
-   if (checkerboard)
+   if (!my_rank)
    {
-      /* What is the length of a side of the local square of data? */
-      *sqrtn = (int)sqrt(n);
-      if (*sqrtn != sqrt(n))
-         return ERR_ARG;
-      *ln = size/(*sqrtn);
-      
-      /* Extra space for ghost rows and colums. */
-      buf_size = (*ln + 2) * (*ln + 2);
+      sprintf(output_file, "ann/out_%d_%d.pgm", p, s);
+      if (rename(st->name[st->cur], output_file))
+         return ERR_WRITE;
    }
-   else
-   {
-      /* How many rows in this block? */
-      *ln = size / n;
+   st->given[st->cur] = 1;
 
-      /* Extra space for ghost rows. */
-      buf_size = (*ln + 2) * size;
-   }
+   return 0;
+}
 
-   /* We will need two grids, one for the current timestep, one for
-    * the next timestep. Using calloc causes all ghost rows (and
-    * columns) to be initialized to zero. */
-   if (!(*cur = calloc(buf_size, 1)))
-      return ERR_DUMB;
-   if (!(*next = calloc(buf_size, 1)))
-      return ERR_DUMB;
+/* Close the stream files, and remove the ones which were not given to
+ * output files. */
+void
+finish_stream(int my_rank, struct stream *st)
+{
+   int f;
 
-   return 0;
+   for (f = 0; f < 2; f++)
+   {
+      close(st->fd[f]);
+      if (!my_rank && !st->given[f])
+         unlink(st->name[f]);
+   }
+   free(st->levels);
 }
 
 int
 main(int argc, char* argv[]) 
 {
    int p, my_rank;
-   int n = 1, size = 4, verbose = 0, num_steps = 1, checkerboard = 0, count = 0;
+   int n = 0, q = 0, size = 0, verbose = 0, num_steps = 0, checkerboard = 0, count = 0;
    int file_type = 0, output = 0, performance = 0, header = 0;
-   int ln, c;
-   unsigned char *cur, *next;
+   int engine = ENGINE_BYTE;
+   int kernel = KERNEL_AUTO;
+   row_kernel_t row_kernel;
+   int nthreads = 1, tile_rows, provided;
+   int overlap = 0;
+   MPI_Comm node;
+   int node_size;
+   int ghost = 1, region[4];
+   struct pool the_pool, *pool = NULL;
+   int tile_size = 0;
+   struct tiles the_tiles, *tiles = NULL;
+   struct decomp dc;
+   int halo_method = HALO_TWO_PHASE;
+   struct halo halo;
+   int balance = 0, min_gain = 10, moved;
+   double calc_time = 0, calc_start, calc_wait;
+   int ln, lc, c;
+   unsigned char *cur = NULL, *next = NULL;
+   uint64_t *pcur = NULL, *pnext = NULL;
+   struct hashlife hl;
+   struct stream st;
+   int band_rows = 0, whole_grid = 0;
+   int next_s, stride = 0, first_cell = 0;
    char input_file[MAX_NAME + 1] = {""};
-   MPI_Datatype col_type;
-   int sqrtn;
+   int rows, cols, format = PGM_RAW, out_format = PGM_RAW;
+   int in_flight = 0;
+   struct snapshots snaps;
+   int key_every = SERIES_KEY_EVERY;
+   struct series series;
+   int ckpt_every = 0, ckpt[4] = {-1, 0, -1, 0}, num_ckpts = 0, first_step = 0;
+   MPI_Datatype ckpt_filetype, ckpt_memtype;
+   double ckpt_time = 0, ckpt_start, run_start;
+   MPI_Offset header_bytes = 0;
+   MPI_Datatype row_type, col_type;
    int event_num[2][NUM_EVENTS];
    MPI_Datatype filetype, memtype;
-   double time, elapsed_time;
+   double time = 0, elapsed_time;
 /*   double init_time, init_start_time;*/
-   int total;
+   struct reduction red = {0};
+   int64_t my_total, *live = NULL;
+   int detect = 0, period, last;
+   int report = 0;
+   char rule_text[MAX_NAME + 1] = DEFAULT_RULE;
+   int rule_given = 0;
+   struct cycles cycles;
+   uint64_t local[2];
    int s;
    int ret;
 
-   /* Initialize MPI. */
-   MPI_Init(&argc, &argv);
-   MPI_Errhandler_set(MPI_COMM_WORLD, MPI_ERRORS_RETURN);
+   /* Initialize MPI. Worker threads never call MPI, so funneled is
+    * all we need. */
+   MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
+   MPI_Comm_set_errhandler(MPI_COMM_WORLD, MPI_ERRORS_RETURN);
 
    /* Learn my rank and the total number of processors. */
    MPI_Comm_rank(MPI_COMM_WORLD, &my_rank);
@@ -781,16 +5078,35 @@ main(int argc, char* argv[])
     v - verbose output
     c - count the number of live cells after each iteration
     k - use checkerboard decomposition (instead of row) 
-    s - size of side of board 
-    n - number of threads
+    s - size of side of board (the default is the size in the input file, or 4)
+    n - number of tasks (must match the number of MPI processes)
+    q - number of columns of processors for checkerboard
     i - input file
-    t - number of timesteps
+    t - number of timesteps (the default is 1, or, for a checkpoint, the rest of its run)
     f - file type
     o - output file name
     p - turn on performance monitoring 
     h - including header
+    e - engine, byte (the default), bit, hash (Hashlife, one processor only) or stream (out of core)
+    x - kernel for the byte engine: auto (the default), scalar, sse2, avx2 or avx512
+    w - number of worker threads per processor
+    a - overlap the halo exchange with computation
+    g - depth of the ghost zones, exchanged every g steps
+    m - method of halo exchange: twophase (the default), persistent, neighbor, shared, rma or packed
+    b - size of the active tiles, which are skipped when still (0, the default, for none)
+    l - rebalance the row bands every this many steps (0, the default, for never)
+    u - percent a rebalance must cut the longest compute time by (default 10)
+    y - format of output files: pgm (the default), pbm, or series for one file for the run
+    j - number of frames between keyframes in a series file (default 100)
+    z - write a checkpoint every this many steps (0, the default, for never)
+    d - number of output files which may be written in the background (default 0)
+    D - look for cycles up to this many steps long, and skip them (0, the default, for never)
+    T - report the time of each phase, across processors, and of the steps
+    r - the rule, as B (birth) and S (survival) neighbor counts (default B3/S23)
+    C - compute in strips this many columns wide, or auto to fit the L2 cache (0, the default, for whole rows)
+    B - rows in each band of the stream engine (0, the default, for about 2 MB of bands a pass), or read and written at a time by the bit engine (0 for about 16 MB)
    */
-   while ((c = getopt(argc, argv, "vc:ks:n:i:t:foph")) != -1)
+   while ((c = getopt(argc, argv, "vc:ks:n:q:i:t:fophe:x:w:ag:m:b:l:u:y:d:j:z:D:Tr:C:B:")) != -1)
       switch (c)
       {
          case 'v':
@@ -808,6 +5124,9 @@ main(int argc, char* argv[])
          case 'n':
             sscanf(optarg, "%d", &n);
             break;
+         case 'q':
+            sscanf(optarg, "%d", &q);
+            break;
          case 'i':
             sscanf(optarg, "%s", input_file);
             break;
@@ -826,9 +5145,124 @@ main(int argc, char* argv[])
          case 'h':
             header++;
             break;
+         case 'e':
+            if (!strcmp(optarg, "byte"))
+               engine = ENGINE_BYTE;
+            else if (!strcmp(optarg, "bit"))
+               engine = ENGINE_BIT;
+            else if (!strcmp(optarg, "hash"))
+               engine = ENGINE_HASH;
+            else if (!strcmp(optarg, "stream"))
+               engine = ENGINE_STREAM;
+            else
+            {
+               fprintf(stderr, "unknown engine %s\n", optarg);
+               return ERR_ARG;
+            }
+            break;
+         case 'x':
+            if (!strcmp(optarg, "auto"))
+               kernel = KERNEL_AUTO;
+            else if (!strcmp(optarg, "scalar"))
+               kernel = KERNEL_SCALAR;
+            else if (!strcmp(optarg, "sse2"))
+               kernel = KERNEL_SSE2;
+            else if (!strcmp(optarg, "avx2"))
+               kernel = KERNEL_AVX2;
+            else if (!strcmp(optarg, "avx512"))
+               kernel = KERNEL_AVX512;
+            else
+            {
+               fprintf(stderr, "unknown kernel %s\n", optarg);
+               return ERR_ARG;
+            }
+            break;
+         case 'w':
+            sscanf(optarg, "%d", &nthreads);
+            break;
+         case 'a':
+            overlap++;
+            break;
+         case 'g':
+            sscanf(optarg, "%d", &ghost);
+            break;
+         case 'b':
+            sscanf(optarg, "%d", &tile_size);
+            break;
+         case 'l':
+            sscanf(optarg, "%d", &balance);
+            break;
+         case 'u':
+            sscanf(optarg, "%d", &min_gain);
+            break;
+         case 'd':
+            sscanf(optarg, "%d", &in_flight);
+            break;
+         case 'j':
+            sscanf(optarg, "%d", &key_every);
+            break;
+         case 'z':
+            sscanf(optarg, "%d", &ckpt_every);
+            break;
+         case 'D':
+            sscanf(optarg, "%d", &detect);
+            break;
+         case 'T':
+            report++;
+            break;
+         case 'r':
+            sscanf(optarg, "%s", rule_text);
+            rule_given++;
+            break;
+         case 'C':
+            if (!strcmp(optarg, "auto"))
+               block_cols = cache_block_cols(sysconf(_SC_LEVEL2_CACHE_SIZE));
+            else
+               sscanf(optarg, "%d", &block_cols);
+            break;
+         case 'B':
+            sscanf(optarg, "%d", &band_rows);
+            break;
+         case 'y':
+            if (!strcmp(optarg, "pgm"))
+               out_format = PGM_RAW;
+            else if (!strcmp(optarg, "pbm"))
+               out_format = PBM_RAW;
+            else if (!strcmp(optarg, "series"))
+               out_format = SERIES_FILE;
+            else
+            {
+               fprintf(stderr, "unknown output format %s\n", optarg);
+               return ERR_ARG;
+            }
+            break;
+         case 'm':
+            if (!strcmp(optarg, "twophase"))
+               halo_method = HALO_TWO_PHASE;
+            else if (!strcmp(optarg, "persistent"))
+               halo_method = HALO_PERSISTENT;
+            else if (!strcmp(optarg, "neighbor"))
+               halo_method = HALO_NEIGHBOR;
+            else if (!strcmp(optarg, "shared"))
+               halo_method = HALO_SHARED;
+            else if (!strcmp(optarg, "rma"))
+               halo_method = HALO_RMA;
+            else if (!strcmp(optarg, "packed"))
+               halo_method = HALO_PACKED;
+            else
+            {
+               fprintf(stderr, "unknown halo exchange %s\n", optarg);
+               return ERR_ARG;
+            }
+            break;
          case '?':
             fprintf (stderr, "gol -v -o -f -c [count_interations] -k -s [size_of_side] "
-            "-n [num_tasks] -i [input_file] -t [num_steps]\n");
+            "-n [num_tasks] -q [proc_cols] -i [input_file] -t [num_steps] -e [byte|bit|hash|stream] "
+            "-x [auto|scalar|sse2|avx2|avx512] -w [threads_per_task] -a "
+            "-g [ghost_depth] -m [twophase|persistent|neighbor|shared|rma|packed] -b [tile_size] "
+            "-l [balance_interval] -u [balance_gain] -y [pgm|pbm|series] -d [files_in_flight] "
+            "-j [key_every] -z [checkpoint_every] -D [max_period] -T -r [rule] "
+            "-C [block_cols|auto] -B [band_rows]\n");
             return ERR_ARG;
          default:
             break;
@@ -843,44 +5277,344 @@ main(int argc, char* argv[])
    if ((ret = MPE_Log_event(event_num[START][INIT], 0, "start init")))
       MPIERR(ret);
 #endif
+   phase_start(INIT);
+
+   /* Build the tables of the rule. */
+   if (parse_rule(rule_text, &rule))
+      ARGERR("bad rule %s\n", rule_text);
+   if (verbose && !my_rank)
+      printf("rule %s\n", rule_text);
+
+   /* The number of tasks defaults to the number of processors, and
+    * may not be anything else. */
+   if (!n)
+      n = p;
+   if (n != p)
+      ARGERR("-n %d does not match the %d processors\n", n, p);
+
+   /* The size of the board comes from the input file, if there is
+    * one, and must match the size the user gave. */
+   if (strlen(input_file))
+   {
+      if ((ret = read_header(input_file, my_rank, verbose, &format, &rows, &cols, 
+                             &header_bytes, ckpt)))
+      {
+         if (!my_rank)
+            fprintf(stderr, "can't read the board in %s\n", input_file);
+         ERR(ret);
+      }
+      if (size && (rows != size || cols != size))
+      {
+         if (!my_rank)
+            fprintf(stderr, "-s %d does not match the %dx%d board in %s\n", size, cols, rows, 
+                    input_file);
+         ERR(ERR_FILE);
+      }
+   }
+   else
+      rows = cols = size ? size : 4;
+
+   /* A checkpoint carries on with its own rule, which -r may not
+    * change. */
+   if (ckpt[2] >= 0 && (ckpt[2] != rule.birth || ckpt[3] != rule.survive))
+   {
+      struct rule r = {ckpt[2], ckpt[3]};
 
-   if (init_grid(my_rank, n, size, checkerboard, &sqrtn, &ln, &cur, &next))
+      format_rule(&r, rule_text);
+      if (rule_given)
+      {
+         if (!my_rank)
+            fprintf(stderr, "the checkpoint %s was taken with rule %s, not the -r rule\n", 
+                    input_file, rule_text);
+         ERR(ERR_ARG);
+      }
+      parse_rule(rule_text, &rule);
+      if (verbose && !my_rank)
+         printf("rule %s, from the checkpoint\n", rule_text);
+   }
+
+   /* A checkpoint carries on from the step after it was taken, to the
+    * end of its run, unless the user asked for a different number of
+    * steps. */
+   first_step = ckpt[0] + 1;
+   if (!num_steps)
+      num_steps = ckpt[1] ? ckpt[1] : 1;
+   if (!my_rank && first_step)
+      printf("restart after step: %d\n", first_step - 1);
+
+   if ((ret = init_grid(p, rows, cols, checkerboard, q, ghost, nthreads, &dc, &tile_rows, 
+                        engine == ENGINE_STREAM || engine == ENGINE_BIT ? NULL : &cur, &next)))
+   {
+      if (ret == ERR_ARG)
+         ARGERR("can't split the board: -q must divide the processors, and -g and -w may be "
+                "no more than the rows (or, for -k, columns) of the smallest block\n");
       ERR(ERR_INIT);
+   }
+   ln = dc.ln;
+   lc = dc.lc;
+
+   /* Overlapping the exchange and deep ghost zones are only done by
+    * the byte engine, and not together, except that the stream engine
+    * computes ghost generations in each pass over its files. */
+   if (overlap && engine != ENGINE_BYTE)
+      ARGERR("-a is only for the byte engine\n");
+   if (ghost > 1 && engine != ENGINE_BYTE && engine != ENGINE_STREAM)
+      ARGERR("-g is only for the byte and stream engines\n");
+   if (overlap && ghost > 1)
+      ARGERR("-a can't be used with -g\n");
+
+   /* The stream engine reads a raw board into its files, which are
+    * split by rows, and renames them to make PGM output files. Its
+    * bands have to be read in one collective read each, and with
+    * threads, they are split into tiles. */
+   if (engine == ENGINE_STREAM)
+   {
+      if (checkerboard)
+         ARGERR("the stream engine can't be used with -k\n");
+      if (!strlen(input_file) || format == PGM_ASCII)
+         ARGERR("the stream engine needs a raw PGM or PBM input file\n");
+      if (ckpt_every)
+         ARGERR("the stream engine can't be used with -z\n");
+      if (output && out_format != PGM_RAW)
+         ARGERR("the stream engine only writes PGM output\n");
+      if ((ret = MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, 
+                                     &node)))
+         MPIERR(ret);
+      MPI_Comm_size(node, &node_size);
+      MPI_Comm_free(&node);
+      if (node_size != p)
+         ARGERR("the stream engine's processors must all be on one node, to share its files\n");
+      if (!band_rows)
+         band_rows = STREAM_BAND_BYTES / ((ghost + 1) * cols) > 0 ? 
+            STREAM_BAND_BYTES / ((ghost + 1) * cols) : 1;
+      if (band_rows > ln)
+         band_rows = ln;
+      if (band_rows < 1 || (long long)band_rows * cols > READ_CHUNK)
+         ARGERR("bad -B %d for the stream engine\n", band_rows);
+      tile_rows = (band_rows + nthreads * TILES_PER_THREAD - 1) / (nthreads * TILES_PER_THREAD);
+   }
+
+   /* The bit engine reads its board, and writes it out, through a byte
+    * grid of band_rows rows, about BIT_BAND_BYTES unless asked for
+    * other bands. Series files, which compare each frame with the last
+    * one, and output in the background, which copies the whole board,
+    * have it unpacked in full instead. */
+   if (engine == ENGINE_BIT)
+   {
+      stride = checkerboard ? lc + 2 : lc;
+      if (!band_rows)
+         band_rows = BIT_BAND_BYTES / stride > 0 ? BIT_BAND_BYTES / stride : 1;
+      if (output && (out_format == SERIES_FILE || in_flight))
+      {
+         whole_grid++;
+         band_rows = ln;
+      }
+      if (band_rows > ln)
+         band_rows = ln;
+      if (band_rows < 1)
+         ARGERR("bad -B %d for the bit engine\n", band_rows);
+      if ((output || ckpt_every) && !(cur = calloc((size_t)(band_rows + 2) * stride, 1)))
+         ERR(ERR_DUMB);
+   }
+
+   /* So are the one phase halo exchanges, which are set up once, for
+    * both grids, and the packed columns, which can be overlapped. */
+   if (block_cols < 0)
+      ARGERR("bad -C %d\n", block_cols);
+   if (halo_method != HALO_TWO_PHASE && engine != ENGINE_BYTE)
+      ARGERR("-m is only for the byte engine\n");
+   if (halo_method != HALO_TWO_PHASE && overlap && halo_method != HALO_PACKED)
+      ARGERR("-a can only be used with -m twophase or packed\n");
+
+   /* Active tiles are computed by the byte engine, one generation at a
+    * time, by the main thread. */
+   if (tile_size)
+   {
+      if (tile_size < 0)
+         ARGERR("bad -b %d\n", tile_size);
+      if (engine != ENGINE_BYTE)
+         ARGERR("-b is only for the byte engine\n");
+      if (overlap || ghost > 1 || nthreads > 1)
+         ARGERR("-b can't be used with -a, -g or -w\n");
+      if ((ret = init_tiles(&dc, tile_size, &the_tiles)))
+         ERR(ret);
+      tiles = &the_tiles;
+   }
+
+   /* Rebalancing moves whole rows between the bands of the row
+    * decomposition of the byte engine. */
+   if (balance < 0)
+      ARGERR("bad -l %d\n", balance);
+   if (balance && (engine != ENGINE_BYTE || checkerboard))
+      ARGERR("-l is only for the byte engine, without -k\n");
+
+   /* The shared and RMA grids are windows the size of the first bands. */
+   if (balance && (halo_method == HALO_SHARED || halo_method == HALO_RMA))
+      ARGERR("-l can't be used with -m shared or rma\n");
+
+   /* Hashlife keeps the whole board on one processor. */
+   if (engine == ENGINE_HASH && p > 1)
+      ARGERR("the hash engine runs on one processor only\n");
+
+   /* Skipping cycles would skip their output files, and Hashlife
+    * already skips repeats. The stream engine doesn't look. */
+   if (detect < 0)
+      ARGERR("bad -D %d\n", detect);
+   if (detect && output)
+      ARGERR("-D can't be used with -o\n");
+   if (detect && (engine == ENGINE_HASH || engine == ENGINE_STREAM))
+      ARGERR("-D is only for the byte and bit engines\n");
+   if (detect)
+      if ((ret = init_cycles(detect, &cycles)))
+         ERR(ret);
+   if ((ret = init_halo(&dc, halo_method, checkerboard, ghost, &cur, &next, &halo)))
+      ERR(ret);
+
+   /* Find the best row kernel this CPU can do, or check that it can do
+    * the one the user asked for. */
+   if (select_row_kernel(my_rank, verbose, &kernel, &row_kernel))
+      ARGERR("kernel not supported on this CPU\n");
+
+   /* Start the worker threads for hybrid MPI + threads runs. */
+   if (nthreads > 1)
+   {
+      if (provided < MPI_THREAD_FUNNELED)
+         ARGERR("-w needs MPI_THREAD_FUNNELED, which this MPI doesn't provide\n");
+      if (engine != ENGINE_BYTE && engine != ENGINE_STREAM)
+         ARGERR("-w is only for the byte and stream engines\n");
+      if ((ret = init_pool(nthreads, checkerboard, ln, lc, ghost, tile_rows, row_kernel, 
+                           &the_pool)))
+         ERR(ret);
+      pool = &the_pool;
+      if (verbose && !my_rank)
+         printf("%d threads per task, %d tiles of %d rows\n", nthreads, pool->ntiles, tile_rows);
+   }
 
    if (verbose && !my_rank)
-      printf("n=%d size=%d input=%s num_steps=%d ln=%d checkboard=%d\n", 
-      n, size, input_file, num_steps, ln, checkerboard);
+      printf("n=%d size=%dx%d input=%s num_steps=%d ln=%d lc=%d checkboard=%d dims=%dx%d\n", 
+      n, rows, cols, input_file, num_steps, ln, lc, checkerboard, dc.dims[0], dc.dims[1]);
 
-   /* Create a column MPI type to send columns of ln+2 length for the
-    * checkeboard data decomposition. */
+   /* Create a column MPI type to send ghost columns of ln+2*ghost
+    * length for the checkeboard data decomposition, and a row type to
+    * send ghost rows without their ghost columns. Local rows are
+    * lc+2*ghost long. */
    if (checkerboard)
    {
-      if ((ret = MPI_Type_vector(ln + 2, 1, ln + 2, MPI_BYTE, &col_type)))
+      if ((ret = MPI_Type_vector(ln + 2 * ghost, ghost, lc + 2 * ghost, MPI_BYTE, &col_type)))
          MPIERR(ret);
       if ((ret = MPI_Type_commit(&col_type)))
          MPIERR(ret);
+      if ((ret = MPI_Type_vector(ghost, lc, lc + 2 * ghost, MPI_BYTE, &row_type)))
+         MPIERR(ret);
+      if ((ret = MPI_Type_commit(&row_type)))
+         MPIERR(ret);
    }
 
-   /* These types are used for reads when MPI types are used, and also
-    * for output. */
-   if (file_type || output)
-      if (create_mpi_types(my_rank, n, size, ln, checkerboard, 
-                           &filetype, &memtype))
+   /* These types are used for output. PBM output, and the keyframes
+    * of series files, pack 8 cells to a byte, and a byte may not be
+    * split between more than two blocks. */
+   if (output && out_format != PGM_RAW && dc.cols / dc.dims[1] < 8)
+      ARGERR("-y pbm and series need blocks at least 8 columns wide\n");
+   if (output && out_format != SERIES_FILE && engine != ENGINE_STREAM)
+      if (create_mpi_types(&dc, checkerboard, ghost, out_format, &filetype, &memtype))
+         ERR(ERR_INIT);
+   if (output && out_format == SERIES_FILE && key_every < 1)
+      ARGERR("bad -j %d\n", key_every);
+   if (output && out_format == SERIES_FILE)
+      if ((ret = init_series(&dc, p, key_every, &series)))
+         ERR(ret);
+
+   /* Checkpoints are PBM files, written with their own types. */
+   if (ckpt_every < 0)
+      ARGERR("bad -z %d\n", ckpt_every);
+   if (ckpt_every && dc.cols / dc.dims[1] < 8)
+      ARGERR("-z needs blocks at least 8 columns wide\n");
+   if (ckpt_every)
+      if (create_mpi_types(&dc, checkerboard, ghost, PBM_RAW, &ckpt_filetype, &ckpt_memtype))
          ERR(ERR_INIT);
 
+   /* Output files may be written while the game goes on, but not a
+    * series file, whose frames depend on each other. */
+   if (in_flight < 0)
+      ARGERR("bad -d %d\n", in_flight);
+   if (in_flight && out_format == SERIES_FILE)
+      ARGERR("-d can't be used with -y series\n");
+   if ((ret = init_snapshots(output ? in_flight : 0, &snaps)))
+      ERR(ret);
+
    /* Initialize the starting configuration. Either read a file or
     * just turn on half the first row. */
    if (verbose && ! my_rank)
       printf("data initilization\n");
-   if ((ret = init_cur(n, my_rank, p, size, ln, cur, input_file, count, 
-                       checkerboard, verbose, event_num, file_type, &filetype, &memtype)))
+   if (engine == ENGINE_STREAM)
+   {
+      if ((ret = init_stream(&dc, my_rank, ghost, band_rows, input_file, format, header_bytes, 
+                             verbose, event_num, &st, count ? &my_total : NULL)))
+         ERR(ret);
+   }
+   else if (engine == ENGINE_BIT)
+   {
+      if ((ret = init_packed_grid(ln, lc, &pcur, &pnext)))
+         ERR(ret);
+      if ((ret = init_packed(&dc, my_rank, input_file, format, header_bytes, checkerboard, 
+                             verbose, event_num, file_type, band_rows, pcur)))
+         ERR(ret);
+   }
+   else if ((ret = init_cur(&dc, my_rank, ghost, cur, input_file, format, header_bytes, 
+                            checkerboard, verbose, event_num, file_type)))
       ERR(ret);
+
+   /* The hash engine builds its quadtree from the board, and also
+    * keeps the byte grid only for output. */
+   if (engine == ENGINE_HASH)
+   {
+      stride = checkerboard ? lc + 2 * ghost : lc;
+      first_cell = ghost * stride + (checkerboard ? ghost : 0);
+      if ((ret = init_hashlife(dc.rows, dc.cols, &cur[first_cell], stride, &hl)))
+         ERR(ret);
+      free(next);
+      next = NULL;
+      if (!output && !ckpt_every)
+      {
+         free(cur);
+         cur = NULL;
+      }
+   }
+
    if (count)
    {
-      if (count_results(my_rank, count, ln, size, checkerboard, event_num, verbose, cur, &total))
+      if (engine == ENGINE_BIT)
+      {
+         if (count_packed_results(my_rank, count, ln, lc, dc.cols, event_num, verbose, 
+                                  pcur, -1, &red))
+            ERR(ERR_COUNT);
+      }
+      else if (engine == ENGINE_HASH)
+      {
+         if (sum_results(my_rank, hl.root->pop, -1, verbose, event_num, &red))
+            ERR(ERR_COUNT);
+      }
+      else if (engine == ENGINE_STREAM)
+      {
+         if (sum_results(my_rank, my_total, -1, verbose, event_num, &red))
+            ERR(ERR_COUNT);
+      }
+      else if (count_results(my_rank, count, ln, lc, dc.cols, checkerboard, ghost, event_num, 
+                             verbose, pool, cur, NULL, -1, &red))
+         ERR(ERR_COUNT);
+      if (finish_results(my_rank, event_num, &red))
+         ERR(ERR_COUNT);
+   }
+
+   /* The starting board begins the history of boards. */
+   if (detect)
+   {
+      if (engine == ENGINE_BIT)
+         digest_packed(&dc, pcur, local);
+      else
+         digest_rows(&dc, checkerboard, ghost, cur, local);
+      if (find_cycle(local, &cycles, &period))
          ERR(ERR_COUNT);
-      if (verbose && !my_rank)
-         printf("initial count - total %d\n", total);
    }
 /*   init_time = MPI_Wtime() - init_start_time;*/
 /*   printf("init time - %f\n", init_time);
@@ -889,6 +5623,7 @@ main(int argc, char* argv[])
    if (verbose && ! my_rank)
       printf("initilization complete\n");
 
+   phase_end(INIT);
 #ifdef LOGGING
    if ((ret = MPE_Log_event(event_num[END][INIT], 0, "end init")))
       MPIERR(ret);
@@ -898,32 +5633,328 @@ main(int argc, char* argv[])
     * buffering of MPI. */
    if (!my_rank && performance)
       time = MPI_Wtime();
-   for (s = 0; s < num_steps; s++)
+   run_start = MPI_Wtime();
+   for (s = first_step; s < num_steps && engine == ENGINE_BIT; s++)
    {
-      if (update_processes(n, my_rank, p, size, ln, sqrtn, checkerboard, 
-                           verbose, col_type, event_num, cur))
+      step_start();
+      if (update_packed_processes(&dc, my_rank, p, checkerboard, verbose, event_num, pcur))
          ERR(ERR_UPDATE);
 
-      if (calculate_next_step(checkerboard, ln, size, event_num, cur, next))
+      if (calculate_packed_step(ln, lc, event_num, pcur, pnext))
          ERR(ERR_CALC);
 
       if (count)
       {
 	 if (!((s + 1) % count))
-	    if (count_results(my_rank, count, ln, size, checkerboard, event_num, verbose, next, &total))
+	 {
+	    if (count_packed_results(my_rank, count, ln, lc, dc.cols, event_num, verbose, 
+                                     pnext, s, &red))
+	       ERR(ERR_COUNT);
+	 }
+      }
+
+      if (output)
+      {
+         if (whole_grid)
+            unpack_rows(checkerboard, lc, ln + 2, pnext, cur);
+	 if (write_output(p, &dc, my_rank, s, checkerboard, ghost, out_format, filetype, 
+                          memtype, verbose, event_num, &snaps, &series, 
+                          whole_grid ? NULL : pnext, band_rows, cur))
+            ERR(ERR_WRITE);
+      }
+
+      if (ckpt_every && !((s + 1) % ckpt_every))
+      {
+         ckpt_start = MPI_Wtime();
+         if (write_checkpoint(&dc, my_rank, s, num_steps, checkerboard, ghost, ckpt_filetype, 
+                              ckpt_memtype, pnext, band_rows, cur))
+            ERR(ERR_WRITE);
+         ckpt_time += MPI_Wtime() - ckpt_start;
+         num_ckpts++;
+      }
+
+      if (swap_packed_buffers(ln, lc, event_num, &pcur, &pnext))
+         ERR(ERR_SWAP);
+
+      /* Once the board repeats, skip ahead. */
+      if (detect)
+      {
+         digest_packed(&dc, pcur, local);
+         if (find_cycle(local, &cycles, &period))
+            ERR(ERR_COUNT);
+         if (period)
+         {
+            if (skip_cycle(my_rank, s, period, num_steps, 1, count, verbose, event_num, 
+                           &cycles, &red, &last))
+               ERR(ERR_COUNT);
+            if (ckpt_every && (last + 1) / ckpt_every > (s + 1) / ckpt_every)
+            {
+               ckpt_start = MPI_Wtime();
+               if (write_checkpoint(&dc, my_rank, last, num_steps, checkerboard, ghost, 
+                                    ckpt_filetype, ckpt_memtype, pcur, band_rows, cur))
+                  ERR(ERR_WRITE);
+               ckpt_time += MPI_Wtime() - ckpt_start;
+               num_ckpts++;
+            }
+            s = last;
+         }
+      }
+      step_end();
+   } /* next s */
+
+   /* Hashlife jumps straight to the next generation that is counted,
+    * written out or checkpointed, or the last one. */
+   for (s = first_step; s < num_steps && engine == ENGINE_HASH; s = next_s)
+   {
+      step_start();
+      next_s = num_steps;
+      if (count && (s / count + 1) * count < next_s)
+         next_s = (s / count + 1) * count;
+      if (ckpt_every && (s / ckpt_every + 1) * ckpt_every < next_s)
+         next_s = (s / ckpt_every + 1) * ckpt_every;
+      if (output)
+         next_s = s + 1;
+
+      if ((ret = hash_step(&hl, next_s - s, event_num)))
+         ERR(ret);
+
+      if (count)
+      {
+	 if (!(next_s % count))
+	 {
+	    if (sum_results(my_rank, hl.root->pop, next_s - 1, verbose, event_num, &red))
+	       ERR(ERR_COUNT);
+	 }
+      }
+
+      if (output || (ckpt_every && !(next_s % ckpt_every)))
+      {
+         memset(cur, 0, (size_t)(ln + 2 * ghost) * stride);
+         hash_unpack(&hl, hl.root, 0, 0, &cur[first_cell], stride);
+      }
+      if (output)
+	 if (write_output(p, &dc, my_rank, next_s - 1, checkerboard, ghost, out_format, 
+                          filetype, memtype, verbose, event_num, &snaps, &series, NULL, 0, 
+                          cur))
+            ERR(ERR_WRITE);
+
+      if (ckpt_every && !(next_s % ckpt_every))
+      {
+         ckpt_start = MPI_Wtime();
+         if (write_checkpoint(&dc, my_rank, next_s - 1, num_steps, checkerboard, ghost, 
+                              ckpt_filetype, ckpt_memtype, NULL, 0, cur))
+            ERR(ERR_WRITE);
+         ckpt_time += MPI_Wtime() - ckpt_start;
+         num_ckpts++;
+      }
+      step_end();
+   } /* next s */
+
+   /* The stream engine also goes to the next generation that is
+    * counted or written out, or the last one, but no more than ghost
+    * generations in a pass. */
+   for (s = first_step; s < num_steps && engine == ENGINE_STREAM; s = next_s)
+   {
+      step_start();
+      next_s = s + ghost < num_steps ? s + ghost : num_steps;
+      if (count && (s / count + 1) * count < next_s)
+         next_s = (s / count + 1) * count;
+      if (output)
+         next_s = s + 1;
+
+      live = count && !(next_s % count) ? &my_total : NULL;
+      if ((ret = stream_pass(&dc, my_rank, next_s - s, event_num, row_kernel, pool, &st, live)))
+         ERR(ret);
+
+      if (live)
+         if (sum_results(my_rank, my_total, next_s - 1, verbose, event_num, &red))
+            ERR(ERR_COUNT);
+
+      if (output)
+         if (stream_output(my_rank, p, next_s - 1, &st))
+            ERR(ERR_WRITE);
+      step_end();
+   } /* next s */
+
+   for (s = first_step; s < num_steps && engine == ENGINE_BYTE; s++)
+   {
+      step_start();
+      /* Every balance steps, see if moving rows between processors
+       * would even out the compute time. This is done just before the
+       * ghost zones are exchanged, so they get filled in again. */
+      if (balance && s > first_step && !(s % balance) && !((s - first_step) % ghost))
+      {
+         if ((ret = rebalance(&dc, my_rank, p, ghost, ghost > nthreads ? ghost : nthreads, 
+                              min_gain, calc_time, verbose, &moved, &cur, &next)))
+            ERR(ret);
+         calc_time = 0;
+
+         /* Everything sized by the old band has to be set up again. */
+         if (moved)
+         {
+            ln = dc.ln;
+            if (pool)
+            {
+               tile_rows = (ln + nthreads * TILES_PER_THREAD - 1) / (nthreads * TILES_PER_THREAD);
+               pool->ln = ln;
+               pool->tile_rows = tile_rows;
+               pool->ntiles = (ln + tile_rows - 1) / tile_rows;
+            }
+            if (tiles)
+            {
+               free(tiles->changed);
+               free(tiles->was_changed);
+               if ((ret = init_tiles(&dc, tile_size, tiles)))
+                  ERR(ret);
+            }
+            finish_halo(&halo);
+            if ((ret = init_halo(&dc, halo_method, checkerboard, ghost, &cur, &next, &halo)))
+               ERR(ret);
+            if (ckpt_every)
+            {
+               MPI_Type_free(&ckpt_filetype);
+               MPI_Type_free(&ckpt_memtype);
+               if (create_mpi_types(&dc, checkerboard, ghost, PBM_RAW, &ckpt_filetype, 
+                                    &ckpt_memtype))
+                  ERR(ERR_BALANCE);
+            }
+            if (output && out_format != SERIES_FILE)
+            {
+               MPI_Type_free(&filetype);
+               MPI_Type_free(&memtype);
+               if (create_mpi_types(&dc, checkerboard, ghost, out_format, &filetype, 
+                                    &memtype))
+                  ERR(ERR_BALANCE);
+            }
+         }
+      }
+
+      /* On the steps which are counted, the kernel counts the live
+       * cells as it goes, except for active tiles, which leave the
+       * still ones out. */
+      live = count && !((s + 1) % count) && !tiles ? &my_total : NULL;
+
+      /* Only the computing counts towards rebalancing, not the time
+       * spent waiting for the neighbours' ghost zones. */
+      calc_start = MPI_Wtime();
+      calc_wait = 0;
+      if (overlap)
+      {
+         if (overlap_next_step(&dc, p, checkerboard, row_type, col_type, halo.col_bufs, 
+                               event_num, row_kernel, pool, cur, next, live, &calc_wait))
+            ERR(ERR_CALC);
+      }
+      else
+      {
+         /* Deep ghost zones only need to be exchanged every ghost
+          * steps, in between we compute a shrinking region. */
+         if (!((s - first_step) % ghost))
+            if (update_processes(&dc, &halo, my_rank, p, checkerboard, ghost, verbose, row_type, 
+                                 col_type, event_num, cur))
+               ERR(ERR_UPDATE);
+         calc_start = MPI_Wtime();
+
+         if (tiles)
+         {
+            if (calculate_tiles(&dc, checkerboard, ghost, tiles, event_num, row_kernel, 
+                                cur, next))
+               ERR(ERR_CALC);
+            if (verbose)
+               printf("%d: step %d computed %d of %d tiles\n", my_rank, s, tiles->nactive, 
+                      tiles->nrows * tiles->ncols);
+         }
+         else
+         {
+            valid_region(&dc, checkerboard, ghost, (s - first_step) % ghost, region);
+            if (calculate_next_step(checkerboard, ln, lc, ghost, region, event_num, 
+                                    row_kernel, pool, cur, next, live))
+               ERR(ERR_CALC);
+         }
+      }
+      calc_time += MPI_Wtime() - calc_start - calc_wait;
+
+      if (count)
+      {
+	 if (!((s + 1) % count))
+	 {
+	    if (count_results(my_rank, count, ln, lc, dc.cols, checkerboard, ghost, event_num, 
+                              verbose, pool, next, live, s, &red))
 	       ERR(ERR_COUNT);
-	 if (!my_rank)
-	    printf("after step: %d total: %d\n", s, total);
+	 }
       }
 
       if (output)
-	 if (write_output(p, size, my_rank, s, ln, filetype, memtype, verbose, event_num, next))
+	 if (write_output(p, &dc, my_rank, s, checkerboard, ghost, out_format, filetype, 
+                          memtype, verbose, event_num, &snaps, &series, NULL, 0, next))
+            ERR(ERR_WRITE);
+
+      if (ckpt_every && !((s + 1) % ckpt_every))
+      {
+         ckpt_start = MPI_Wtime();
+         if (write_checkpoint(&dc, my_rank, s, num_steps, checkerboard, ghost, ckpt_filetype, 
+                              ckpt_memtype, NULL, 0, next))
             ERR(ERR_WRITE);
+         ckpt_time += MPI_Wtime() - ckpt_start;
+         num_ckpts++;
+         if (verbose && !my_rank)
+            printf("checkpoint after step %d took %f s\n", s, MPI_Wtime() - ckpt_start);
+      }
 
-      if (swap_buffers(ln, size, checkerboard, event_num, &cur, &next))
+      if (swap_buffers(ln, lc, checkerboard, ghost, event_num, pool, tiles, &cur, &next))
          ERR(ERR_SWAP);
+
+      /* Once the board repeats, skip ahead. */
+      if (detect)
+      {
+         digest_rows(&dc, checkerboard, ghost, cur, local);
+         if (find_cycle(local, &cycles, &period))
+            ERR(ERR_COUNT);
+         if (period)
+         {
+            if (skip_cycle(my_rank, s, period, num_steps, ghost, count, verbose, event_num, 
+                           &cycles, &red, &last))
+               ERR(ERR_COUNT);
+            if (ckpt_every && (last + 1) / ckpt_every > (s + 1) / ckpt_every)
+            {
+               ckpt_start = MPI_Wtime();
+               if (write_checkpoint(&dc, my_rank, last, num_steps, checkerboard, ghost, 
+                                    ckpt_filetype, ckpt_memtype, NULL, 0, cur))
+                  ERR(ERR_WRITE);
+               ckpt_time += MPI_Wtime() - ckpt_start;
+               num_ckpts++;
+            }
+            s = last;
+         }
+      }
+      step_end();
    } /* next s */
 
+   /* The last total is still on its way. */
+   if (finish_results(my_rank, event_num, &red))
+      ERR(ERR_COUNT);
+
+   /* Report what the checkpoints cost, so their frequency can be
+    * tuned. */
+   if (num_ckpts && !my_rank)
+      printf("%d checkpoints, every %d steps, %f s each, %.1f%% of run time\n", num_ckpts, 
+             ckpt_every, ckpt_time / num_ckpts, 100 * ckpt_time / (MPI_Wtime() - run_start));
+   if (ckpt_every)
+   {
+      MPI_Type_free(&ckpt_filetype);
+      MPI_Type_free(&ckpt_memtype);
+   }
+
+   /* Wait for the last output files to be written. */
+   if (finish_snapshots(&snaps))
+      ERR(ERR_WRITE);
+   if (output && out_format == SERIES_FILE)
+      if (finish_series(&dc, my_rank, &series))
+         ERR(ERR_WRITE);
+
+   if (report)
+      if (report_timers(my_rank, p))
+         ERR(ERR_COUNT);
+
    /* Wait for everyone to get performance. */
    if (performance)
       if ((ret = MPI_Barrier(MPI_COMM_WORLD)))
@@ -934,12 +5965,35 @@ main(int argc, char* argv[])
       if (header)
          printf("n, p, cb, size, avg time\n");
       elapsed_time = MPI_Wtime() - time;
-      printf("%d, %d, %d, %d, %f\n", n, p, checkerboard, size, elapsed_time/num_steps);
+      printf("%d, %d, %d, %d, %f\n", n, p, checkerboard, cols, elapsed_time/num_steps);
    }
 
    /* Fold our tents. */
-   free(cur);
-   free(next);
+   if (pool)
+      finish_pool(pool);
+   if (halo.method != HALO_SHARED && halo.method != HALO_RMA)
+   {
+      free(cur);
+      free(next);
+   }
+   free(pcur);
+   free(pnext);
+   if (engine == ENGINE_HASH)
+      finish_hashlife(&hl);
+   if (engine == ENGINE_STREAM)
+      finish_stream(my_rank, &st);
+   if (tiles)
+   {
+      free(tiles->changed);
+      free(tiles->was_changed);
+   }
+   finish_halo(&halo);
+   if (detect)
+   {
+      free(cycles.digest);
+      free(cycles.total);
+   }
+   MPI_Comm_free(&dc.comm);
 
 /* #ifdef LOGGING */
 /*    { */
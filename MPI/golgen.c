@@ -0,0 +1,129 @@
+/* Make boards for benchmarking gol, as PBM files, which gol reads.
+
+   golgen pattern rows cols out.pbm [seed]
+
+   The patterns are the workloads of benchmark.sh:
+
+   random - half the cells alive, at random
+   sparse - one cell in fifty alive, at random
+   acorns - acorns, which take 5206 steps to settle, every 128 cells
+   guns   - Gosper glider guns, every 64 cells, firing into each other
+
+   The patterns repeat across the board, so any size has about the
+   same amount of work per cell.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ACORN_SPACING 128
+#define GUN_SPACING 64
+
+/* Some error codes for when things go wrong. */
+#define ERR_FILE 1
+#define ERR_DUMB 2
+#define ERR_ARG 3
+
+/* The small patterns, as rows of . and O. */
+static const char *acorn[] = {
+   ".O.....",
+   "...O...",
+   "OO..OOO",
+   NULL
+};
+
+static const char *gun[] = {
+   "........................O...........",
+   "......................O.O...........",
+   "............OO......OO............OO",
+   "...........O...O....OO............OO",
+   "OO........O.....O...OO..............",
+   "OO........O...O.OO....O.O...........",
+   "..........O.....O.......O...........",
+   "...........O...O....................",
+   "............OO......................",
+   NULL
+};
+
+/* Put a pattern on the board with its top left corner at (r, c),
+ * flipped left to right if flip is set, leaving out what doesn't
+ * fit. */
+void
+place(const char **pattern, int flip, long r, long c, long rows, long cols,
+      unsigned char *board)
+{
+   long i, j, w;
+
+   for (i = 0; pattern[i]; i++)
+      for (w = strlen(pattern[i]), j = 0; j < w; j++)
+         if (pattern[i][flip ? w - 1 - j : j] == 'O' && r + i < rows && c + j < cols)
+            board[(r + i) * cols + c + j] = 1;
+}
+
+int
+main(int argc, char *argv[])
+{
+   FILE *out;
+   long rows, cols, i, j, k;
+   unsigned char *board, byte;
+   unsigned seed = 1;
+
+   if (argc != 5 && argc != 6)
+   {
+      fprintf(stderr, "golgen random|sparse|acorns|guns rows cols out.pbm [seed]\n");
+      return ERR_ARG;
+   }
+   rows = atol(argv[2]);
+   cols = atol(argv[3]);
+   if (argc == 6)
+      seed = (unsigned)atol(argv[5]);
+   if (rows < 1 || cols < 1)
+      return ERR_ARG;
+   if (!(board = calloc(rows * cols, 1)))
+      return ERR_DUMB;
+   srand(seed);
+
+   if (!strcmp(argv[1], "random"))
+      for (i = 0; i < rows * cols; i++)
+         board[i] = rand() % 2;
+   else if (!strcmp(argv[1], "sparse"))
+      for (i = 0; i < rows * cols; i++)
+         board[i] = !(rand() % 50);
+   else if (!strcmp(argv[1], "acorns"))
+   {
+      for (i = ACORN_SPACING / 2; i < rows; i += ACORN_SPACING)
+         for (j = ACORN_SPACING / 2; j < cols; j += ACORN_SPACING)
+            place(acorn, 0, i, j, rows, cols, board);
+   }
+   else if (!strcmp(argv[1], "guns"))
+   {
+      /* Every other column of guns faces the other way. */
+      for (i = 1; i < rows; i += GUN_SPACING)
+         for (j = 1; j < cols; j += GUN_SPACING)
+            place(gun, (j / GUN_SPACING) % 2, i, j, rows, cols, board);
+   }
+   else
+   {
+      fprintf(stderr, "unknown pattern %s\n", argv[1]);
+      return ERR_ARG;
+   }
+
+   /* Write it a bit per cell, the first cell in the high bit. */
+   if (!(out = fopen(argv[4], "wb")))
+      return ERR_FILE;
+   fprintf(out, "P4\n%ld %ld\n", cols, rows);
+   for (i = 0; i < rows; i++)
+      for (j = 0; j < cols; j += 8)
+      {
+         for (byte = 0, k = 0; k < 8 && j + k < cols; k++)
+            if (board[i * cols + j + k])
+               byte |= 1 << (7 - k);
+         if (fputc(byte, out) == EOF)
+            return ERR_FILE;
+      }
+   fclose(out);
+   free(board);
+
+   return 0;
+}
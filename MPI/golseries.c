@@ -0,0 +1,194 @@
+/* Read the series files written by gol -o -y series, which hold every
+   generation of a run in one file: keyframes of the whole board,
+   packed a bit per cell as in a PBM file, and the runs between the
+   cells which changed in the frames between them. See init_series in gol.c for the
+   layout.
+
+   golseries file.gol           - list the frames in the file
+   golseries file.gol N out.pgm - write generation N to out.pgm
+
+   Generation N is found by starting at the last keyframe before it,
+   and applying the changes of each frame after that, up to N.
+*/
+
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#define SERIES_MAGIC "GOLTS002"
+#define SERIES_HEADER_WORDS 6
+#define SERIES_INDEX_WORDS 4
+
+/* Some error codes for when things go wrong. */
+#define ERR_FILE 1
+#define ERR_DUMB 2
+#define ERR_ARG 3
+
+/* Read n bytes at offset off. */
+int
+read_at(FILE *fp, int64_t off, void *buf, size_t n)
+{
+   if (fseeko(fp, off, SEEK_SET) || fread(buf, 1, n, fp) != n)
+      return ERR_FILE;
+   return 0;
+}
+
+/* Unpack a keyframe into the board, a byte per cell. */
+int
+read_keyframe(FILE *fp, int64_t off, int64_t rows, int64_t cols, unsigned char *board)
+{
+   int64_t row_bytes = (cols + 7) / 8;
+   unsigned char *bits;
+   int64_t i, j;
+   int ret;
+
+   if (!(bits = malloc(row_bytes)))
+      return ERR_DUMB;
+   for (i = 0; i < rows; i++)
+   {
+      if ((ret = read_at(fp, off + i * row_bytes, bits, row_bytes)))
+         return ret;
+      for (j = 0; j < cols; j++)
+         board[i * cols + j] = (bits[j / 8] >> (7 - j % 8)) & 1 ? 255 : 0;
+   }
+   free(bits);
+
+   return 0;
+}
+
+/* Decode the varint at buf[*pos], of n bytes, into v. */
+int
+get_varint(unsigned char *buf, int64_t n, int64_t *pos, uint64_t *v)
+{
+   int shift;
+
+   *v = 0;
+   for (shift = 0; shift < 64; shift += 7)
+   {
+      if (*pos >= n)
+         return ERR_FILE;
+      *v |= (uint64_t)(buf[*pos] & 0x7f) << shift;
+      if (!(buf[(*pos)++] & 0x80))
+         return 0;
+   }
+
+   return ERR_FILE;
+}
+
+/* Flip the cells of the delta of n bytes at off, one part after
+   another, each a count and then the runs between changed cells. */
+int
+apply_changes(FILE *fp, int64_t off, int64_t n, int64_t cells, unsigned char *board)
+{
+   unsigned char *buf;
+   int64_t pos = 0;
+   uint64_t count, run, cell, k;
+   int ret;
+
+   if (!(buf = malloc(n ? n : 1)))
+      return ERR_DUMB;
+   if ((ret = read_at(fp, off, buf, n)))
+      return ret;
+   while (pos < n)
+   {
+      if ((ret = get_varint(buf, n, &pos, &count)))
+         return ret;
+      for (cell = 0, k = 0; k < count; k++, cell++)
+      {
+         if ((ret = get_varint(buf, n, &pos, &run)))
+            return ret;
+         cell += run;
+         if (cell >= cells)
+            return ERR_FILE;
+         board[cell] = board[cell] ? 0 : 255;
+      }
+   }
+   free(buf);
+
+   return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+   FILE *fp, *out;
+   int64_t header[SERIES_HEADER_WORDS], *index;
+   int64_t rows, cols, nframes, gen;
+   unsigned char *board;
+   int64_t f, k, key;
+   int ret;
+
+   if (argc != 2 && argc != 4)
+   {
+      fprintf(stderr, "golseries file.gol [generation out.pgm]\n");
+      return ERR_ARG;
+   }
+
+   /* Read the header and the index. */
+   if (!(fp = fopen(argv[1], "rb")))
+      return ERR_FILE;
+   if ((ret = read_at(fp, 0, header, sizeof(header))))
+      return ret;
+   if (memcmp(header, SERIES_MAGIC, sizeof(int64_t)))
+   {
+      fprintf(stderr, "%s is not a series file\n", argv[1]);
+      return ERR_FILE;
+   }
+   rows = header[1];
+   cols = header[2];
+   nframes = header[4];
+   if (!(index = malloc(nframes * SERIES_INDEX_WORDS * sizeof(int64_t))))
+      return ERR_DUMB;
+   if ((ret = read_at(fp, header[5], index, nframes * SERIES_INDEX_WORDS * sizeof(int64_t))))
+      return ret;
+
+   /* List the frames. */
+   if (argc == 2)
+   {
+      printf("%lld x %lld board, %lld frames, keyframe every %lld\n", (long long)cols,
+             (long long)rows, (long long)nframes, (long long)header[3]);
+      for (f = 0; f < nframes; f++)
+         printf("step %lld at %lld: %s of %lld bytes\n", (long long)index[f * SERIES_INDEX_WORDS],
+                (long long)index[f * SERIES_INDEX_WORDS + 1],
+                index[f * SERIES_INDEX_WORDS + 2] ? "keyframe" : "changes",
+                (long long)index[f * SERIES_INDEX_WORDS + 3]);
+      return 0;
+   }
+
+   /* Find the frame, and the last keyframe at or before it. */
+   gen = atoll(argv[2]);
+   for (f = 0; f < nframes && index[f * SERIES_INDEX_WORDS] != gen; f++)
+      ;
+   if (f == nframes)
+   {
+      fprintf(stderr, "generation %lld is not in %s\n", (long long)gen, argv[1]);
+      return ERR_ARG;
+   }
+   for (key = f; !index[key * SERIES_INDEX_WORDS + 2]; key--)
+      ;
+
+   /* Rebuild the board. */
+   if (!(board = malloc(rows * cols)))
+      return ERR_DUMB;
+   if ((ret = read_keyframe(fp, index[key * SERIES_INDEX_WORDS + 1], rows, cols, board)))
+      return ret;
+   for (k = key + 1; k <= f; k++)
+      if ((ret = apply_changes(fp, index[k * SERIES_INDEX_WORDS + 1],
+                               index[k * SERIES_INDEX_WORDS + 3], rows * cols, board)))
+         return ret;
+   fclose(fp);
+
+   /* Write it out as a PGM file, like gol -o. */
+   if (!(out = fopen(argv[3], "wb")))
+      return ERR_FILE;
+   fprintf(out, "P5\n%lld %lld\n255\n", (long long)cols, (long long)rows);
+   if (fwrite(board, 1, rows * cols, out) != rows * cols)
+      return ERR_FILE;
+   fclose(out);
+   free(board);
+   free(index);
+
+   return 0;
+}